@@ -0,0 +1,507 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// in-process microbenchmarks, run via "make bench"
+
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "qdns.h"
+#include "zone.h"
+#include "lpm.h"
+#include "misc.h"
+
+
+using namespace std;
+
+
+// every heap allocation of the process, for the allocs/op figures
+static size_t allocs = 0;
+
+
+void *operator new(size_t n)
+{
+	++allocs;
+	if (void *p = malloc(n ? n : 1))
+		return p;
+	throw bad_alloc();
+}
+
+
+void *operator new(size_t n, const nothrow_t &) noexcept
+{
+	++allocs;
+	return malloc(n ? n : 1);
+}
+
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+
+void operator delete(void *p, const nothrow_t &) noexcept
+{
+	free(p);
+}
+
+
+namespace qdns {
+
+struct bench_access {
+
+	typedef qdns::worker worker;
+
+	// a worker serving q's zone, as loop() would set it up
+	static worker *make_worker(qdns &q)
+	{
+		worker *w = new worker();
+		w->z = q.z.load();
+		w->rr_pos.assign(w->z->size(), 0);
+		w->once.init(1<<16, 3600, 32, 128);
+		w->io = new socket_provider();	// never opened
+		return w;
+	}
+};
+
+}
+
+
+namespace {
+
+const uint16_t qtype_a = htons(1);
+
+
+// n wire format names, packed back to back
+struct name_set {
+	string data;
+	vector<uint32_t> off;
+	vector<uint8_t> len;
+
+	string get(size_t i) const
+	{
+		return data.substr(off[i], len[i]);
+	}
+};
+
+
+void make_names(size_t n, const char *fmt, name_set &ns)
+{
+	char host[256];
+	string qname = "";
+
+	ns.data.clear();
+	ns.off.clear();
+	ns.len.clear();
+	ns.off.reserve(n);
+	ns.len.reserve(n);
+
+	for (size_t i = 0; i < n; ++i) {
+		snprintf(host, sizeof(host), fmt, i, i % 1000);
+		qdns::host2qname(host, qname);
+		ns.off.push_back(ns.data.size());
+		ns.len.push_back(qname.size());
+		ns.data += qname;
+	}
+}
+
+
+double now_ns()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+void bench_index(size_t n, size_t lookups, bool with_map)
+{
+	name_set names, misses;
+	make_names(n, "host%zu.zone%zu.example.com", names);
+	make_names(lookups < n ? lookups : n, "nohost%zu.zone%zu.example.com", misses);
+
+	// random order, so large tables really miss the cache. The query
+	// names themselves are laid out in lookup order, like packets
+	// arriving in a receive buffer would be
+	mt19937 rng(n);
+	name_set hits, nohits;
+	for (size_t i = 0; i < lookups; ++i) {
+		size_t o = rng() % n;
+		hits.off.push_back(hits.data.size());
+		hits.len.push_back(names.len[o]);
+		hits.data.append(names.data, names.off[o], names.len[o]);
+
+		o %= misses.off.size();
+		nohits.off.push_back(nohits.data.size());
+		nohits.len.push_back(misses.len[o]);
+		nohits.data.append(misses.data, misses.off[o], misses.len[o]);
+	}
+
+	qdns::name_index idx;
+	idx.reserve(n);
+
+	double t0 = now_ns();
+	for (size_t i = 0; i < n; ++i)
+		idx.insert(names.get(i), qtype_a, i);
+	double t_insert = (now_ns() - t0)/n;
+
+	uint64_t sum = 0;
+	uint32_t val = 0;
+
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i) {
+		if (idx.find(hits.data.c_str() + hits.off[i], hits.len[i], qtype_a, val))
+			sum += val;
+	}
+	double t_hit = (now_ns() - t0)/lookups;
+
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i) {
+		if (idx.find(nohits.data.c_str() + nohits.off[i], nohits.len[i], qtype_a, val))
+			sum += val;
+	}
+	double t_miss = (now_ns() - t0)/lookups;
+
+	printf("name_index   %9zu records: insert %7.1f ns/op  hit %7.1f ns/op  miss %7.1f ns/op\n",
+	       n, t_insert, t_hit, t_miss);
+
+	if (!with_map) {
+		if (sum == 42)
+			printf("\n");
+		return;
+	}
+
+	// what exact_matches used to be
+	map<pair<string, uint16_t>, uint32_t> m;
+
+	t0 = now_ns();
+	for (size_t i = 0; i < n; ++i)
+		m[make_pair(names.get(i), qtype_a)] = i;
+	t_insert = (now_ns() - t0)/n;
+
+	// the old lookup built a std::string qname per query as well
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i) {
+		auto it = m.find(make_pair(hits.get(i), qtype_a));
+		if (it != m.end())
+			sum += it->second;
+	}
+	t_hit = (now_ns() - t0)/lookups;
+
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i) {
+		auto it = m.find(make_pair(nohits.get(i), qtype_a));
+		if (it != m.end())
+			sum += it->second;
+	}
+	t_miss = (now_ns() - t0)/lookups;
+
+	printf("std::map     %9zu records: insert %7.1f ns/op  hit %7.1f ns/op  miss %7.1f ns/op\n",
+	       n, t_insert, t_hit, t_miss);
+
+	if (sum == 42)
+		printf("\n");
+}
+
+
+// the view lookup of every query: n random networks per family, /8 to
+// /32 and /16 to /64, and clients at random addresses
+void bench_prefixes(size_t n, size_t lookups)
+{
+	mt19937_64 rng(n);
+	qdns::prefix_table nets4, nets6;
+	uint8_t addr[16];
+
+	double t0 = now_ns();
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t a = rng(), b = rng();
+		memcpy(addr, &a, sizeof(a));
+		memcpy(addr + 8, &b, sizeof(b));
+		nets4.add(addr, 4, 8 + a % 25, 1 + i % 255);
+		nets6.add(addr, 16, 16 + b % 49, 1 + i % 255);
+	}
+	if (nets4.build() < 0 || nets6.build() < 0) {
+		printf("prefix_table: build failed\n");
+		return;
+	}
+	double t_build = (now_ns() - t0)/(2*n);
+
+	vector<uint64_t> clients(2*lookups);
+	for (auto &c : clients)
+		c = rng();
+
+	uint64_t sum = 0;
+
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i)
+		sum += nets4.find(clients[i] & 0xffffffff00000000ULL, 0);
+	double t_v4 = (now_ns() - t0)/lookups;
+
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i)
+		sum += nets6.find(clients[2*i], clients[2*i + 1]);
+	double t_v6 = (now_ns() - t0)/lookups;
+
+	printf("prefix_table %9zu networks: build %7.1f ns/op  IPv4 %7.1f ns/op  IPv6 %7.1f ns/op\n",
+	       n, t_build, t_v4, t_v6);
+
+	if (sum == 42)
+		printf("\n");
+}
+
+
+void report(const char *what, size_t ops, double t0, size_t a0)
+{
+	printf("%-36s %7.1f ns/op  %5.2f allocs/op\n", what, (now_ns() - t0)/ops, double(allocs - a0)/ops);
+}
+
+
+void bench_encoding(size_t lookups)
+{
+	name_set names;
+	make_names(lookups, "host%zu.zone%zu.example.com", names);
+
+	vector<string> hosts;
+	hosts.reserve(lookups);
+	for (size_t i = 0; i < lookups; ++i)
+		hosts.push_back(string("host") + to_string(i) + ".zone" + to_string(i % 1000) + ".example.com");
+
+	// what the zone parser encodes, and what logging decodes
+	string out = "";
+	size_t sum = 0, a0 = allocs;
+	double t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i)
+		sum += qdns::host2qname(hosts[i], out);
+	report("host2qname", lookups, t0, a0);
+
+	a0 = allocs;
+	t0 = now_ns();
+	for (size_t i = 0; i < lookups; ++i)
+		sum += qdns::qname2host(names.get(i), out);
+	report("qname2host", lookups, t0, a0);
+
+	if (sum == 42)
+		printf("\n");
+}
+
+
+enum zone_kind {
+	ZONE_EXACT,	// one A RR per name
+	ZONE_WILD,	// one wildcard A RR per subdomain
+	ZONE_RR		// eight A RRs per name, answered round-robin
+};
+
+
+// A zone file of about n RRs, plus the [forward] SOA so that misses
+// are answered NXDOMAIN. Returns its name, or "" on error.
+string make_zone(zone_kind kind, size_t n)
+{
+	char file[] = "/tmp/qdns-bench.XXXXXX";
+	int fd = mkstemp(file);
+	if (fd < 0)
+		return "";
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		return "";
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (kind == ZONE_EXACT)
+			fprintf(f, "host%zu.zone%zu.example.com\t3600\tIN\tA\t10.%zu.%zu.%zu\n", i, i % 1000, (i>>16) & 0xff, (i>>8) & 0xff, i & 0xff);
+		else if (kind == ZONE_WILD)
+			fprintf(f, "*.zone%zu.example.com\t3600\tIN\tA\t10.%zu.%zu.%zu\n", i, (i>>16) & 0xff, (i>>8) & 0xff, i & 0xff);
+		else
+			fprintf(f, "host%zu.zone%zu.example.com\t3600\tIN\tA\t10.0.0.%zu\n", i/8, (i/8) % 1000, i % 8);
+	}
+	fprintf(f, "[forward]\t3600\tIN\tSOA\tns.example.com\n@[forward]\tSOA\nns.example.com\t3600\tIN\tA\t10.0.0.53\n");
+
+	fclose(f);
+	return file;
+}
+
+
+// query packets as they arrive: header with RD set, the question, back to back
+void make_queries(const name_set &names, size_t lookups, size_t n, mt19937 &rng, name_set &pkts)
+{
+	uint16_t tail[2] = {qtype_a, htons(1)};
+
+	for (size_t i = 0; i < lookups; ++i) {
+		size_t o = rng() % n;
+		uint16_t hdr[6] = {uint16_t(rng()), htons(0x0100), htons(1), 0, 0, 0};
+
+		pkts.off.push_back(pkts.data.size());
+		pkts.data.append(reinterpret_cast<char *>(hdr), sizeof(hdr));
+		pkts.data.append(names.data, names.off[o], names.len[o]);
+		pkts.data.append(reinterpret_cast<char *>(tail), sizeof(tail));
+		pkts.len.push_back(pkts.data.size() - pkts.off.back());
+	}
+}
+
+
+void bench_zone(zone_kind kind, size_t n, size_t lookups)
+{
+	static const char *kinds[] = {"exact", "wildcard", "round-robin"};
+
+	string file = make_zone(kind, n);
+	if (file.empty()) {
+		perror("make_zone");
+		return;
+	}
+
+	qdns::qdns q;
+	char what[128];
+
+	// parse_zone() tells how many RRs it found
+	streambuf *sb = cout.rdbuf(nullptr);
+	size_t a0 = allocs;
+	double t0 = now_ns();
+	int r = q.parse_zone(file);
+	cout.rdbuf(sb);
+	cout.clear();
+	unlink(file.c_str());
+	if (r < 0) {
+		printf("parse_zone: %s\n", q.why());
+		return;
+	}
+	snprintf(what, sizeof(what), "parse_zone %s %zu", kinds[kind], n);
+	report(what, n, t0, a0);
+
+	// names that are in the zone, or below a wildcard of it, and ones that are not
+	name_set names, misses, hits, nohits;
+	size_t nnames = kind == ZONE_RR ? (n + 7)/8 : n;
+	make_names(nnames, "host%zu.zone%zu.example.com", names);
+	make_names(nnames, "host%zu.nozone%zu.example.com", misses);
+
+	mt19937 rng(n);
+	make_queries(names, lookups, nnames, rng, hits);
+	make_queries(misses, lookups, nnames, rng, nohits);
+
+	qdns::bench_access::worker *w = qdns::bench_access::make_worker(q);
+	qdns::dns_msg msg;
+	qdns::query_log ql;
+	size_t sum = 0;
+
+	for (auto pkts : {&hits, &nohits}) {
+		a0 = allocs;
+		t0 = now_ns();
+		for (size_t i = 0; i < lookups; ++i) {
+			msg.qbuf = pkts->data.c_str() + pkts->off[i];
+			msg.qlen = pkts->len[i];
+			if (q.parse_packet(w, msg, ql) > 0)
+				sum += msg.rlen;
+		}
+		snprintf(what, sizeof(what), "parse_packet %s %s", kinds[kind], pkts == &hits ? "hit" : "NXDOMAIN");
+		report(what, lookups, t0, a0);
+	}
+
+	// the hits again, from 256 client networks through a rate limiter
+	// that never limits, for what its lookup costs
+	if (kind == ZONE_EXACT && w->rrl.init(1<<16, 1000000000, 1000000000, 15, 2, 24, 56) == 0) {
+		sockaddr_in *sin = reinterpret_cast<sockaddr_in *>(&msg.peer);
+		sin->sin_family = AF_INET;
+
+		a0 = allocs;
+		t0 = now_ns();
+		for (size_t i = 0; i < lookups; ++i) {
+			sin->sin_addr.s_addr = htonl(0x0a000000 | (i & 0xff)<<8);
+			msg.qbuf = hits.data.c_str() + hits.off[i];
+			msg.qlen = hits.len[i];
+			if (q.parse_packet(w, msg, ql) > 0)
+				sum += msg.rlen;
+		}
+		snprintf(what, sizeof(what), "parse_packet %s hit, RRL", kinds[kind]);
+		report(what, lookups, t0, a0);
+	}
+
+	delete w;
+
+	if (sum == 42)
+		printf("\n");
+}
+
+
+void usage()
+{
+	printf("\nmicrobench [-n max records(=1000000)] [-l lookups(=1000000)] [-m max records for std::map(=1000000)]\n"
+	       "           [-z zone records(=100000)]\n\n");
+}
+
+}
+
+
+int main(int argc, char **argv)
+{
+	size_t max = 1000000, lookups = 1000000, map_max = 1000000, zsize = 100000;
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "n:l:m:z:")) != -1) {
+		switch (c) {
+		case 'n':
+			max = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			lookups = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			map_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			zsize = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (lookups == 0)
+		lookups = 1;
+	if (zsize == 0)
+		zsize = 1;
+
+	printf("\n== exact match index, %zu random lookups per size ==\n\n", lookups);
+	for (size_t n = 100; n <= max; n *= 10)
+		bench_index(n, lookups, n <= map_max);
+
+	printf("\n== view lookup, %zu random clients per size ==\n\n", lookups);
+	for (size_t n = 1000; n <= max; n *= 10)
+		bench_prefixes(n, lookups);
+
+	printf("\n== name encoding, %zu names ==\n\n", lookups);
+	bench_encoding(lookups);
+
+	printf("\n== zones of %zu records, %zu queries each ==\n\n", zsize, lookups);
+	bench_zone(ZONE_EXACT, zsize, lookups);
+	bench_zone(ZONE_WILD, zsize, lookups);
+	bench_zone(ZONE_RR, zsize, lookups);
+
+	return 0;
+}
+
@@ -0,0 +1,537 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// qdns-bench: UDP load generator measuring throughput and latency of a
+// running qdns, built via "make qdns-bench"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <strings.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "misc.h"
+
+
+using namespace std;
+
+
+namespace {
+
+struct config {
+	sockaddr_storage server;
+	socklen_t slen;
+	size_t threads, window;
+	double duration, qps;
+	uint64_t timeout;	// ns
+	unsigned seed;
+};
+
+
+// Latencies in ns, bucketed with 64 linear steps per power of two,
+// so any percentile is off by less than 2%
+class histogram {
+
+	enum : unsigned {
+		sub_bits = 6,
+		sub = 1<<sub_bits
+	};
+
+	vector<uint64_t> buckets;
+
+	static size_t index(uint64_t v)
+	{
+		if (v < sub)
+			return v;
+		unsigned msb = 63 - __builtin_clzll(v);
+		return (msb - sub_bits + 1)*sub + ((v >> (msb - sub_bits)) & (sub - 1));
+	}
+
+	static uint64_t value(size_t i)
+	{
+		if (i < sub)
+			return i;
+		unsigned msb = i/sub + sub_bits - 1;
+		return (sub + i % sub) << (msb - sub_bits);
+	}
+
+public:
+
+	histogram() : buckets((64 - sub_bits + 1)*sub, 0)
+	{
+	}
+
+	void add(uint64_t v)
+	{
+		++buckets[index(v)];
+	}
+
+	void merge(const histogram &h)
+	{
+		for (size_t i = 0; i < buckets.size(); ++i)
+			buckets[i] += h.buckets[i];
+	}
+
+	// value below which fraction p of all samples are
+	uint64_t percentile(double p) const
+	{
+		uint64_t total = 0, seen = 0;
+		for (auto b : buckets)
+			total += b;
+		if (total == 0)
+			return 0;
+
+		uint64_t want = p*total;
+		if (want >= total)
+			want = total - 1;
+		for (size_t i = 0; i < buckets.size(); ++i) {
+			seen += buckets[i];
+			if (seen > want)
+				return value(i);
+		}
+		return 0;
+	}
+};
+
+
+struct result {
+	uint64_t sent, received, lost, unexpected, send_errors;
+	uint64_t rcodes[16];
+	uint64_t max;
+	histogram lat;
+
+	result() : sent(0), received(0), lost(0), unexpected(0), send_errors(0), max(0)
+	{
+		memset(rcodes, 0, sizeof(rcodes));
+	}
+};
+
+
+uint64_t now_ns()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+int dns_type(const char *type)
+{
+	static const struct {
+		const char *name;
+		int type;
+	} types[] = {
+		{"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"PTR", 12},
+		{"MX", 15}, {"TXT", 16}, {"AAAA", 28}, {"SRV", 33}
+	};
+
+	for (auto &t : types) {
+		if (strcasecmp(type, t.name) == 0)
+			return t.type;
+	}
+	return -1;
+}
+
+
+// the query packet, ID left 0
+int add_query(const string &host, int type, vector<string> &queries)
+{
+	string qname = "";
+	if (qdns::host2qname(host, qname) <= 0 || qname.size() > 255)
+		return -1;
+
+	// RD set, one question, class IN
+	uint16_t hdr[6] = {0, htons(0x0100), htons(1), 0, 0, 0};
+	uint16_t tail[2] = {htons(type), htons(1)};
+
+	string pkt(reinterpret_cast<char *>(hdr), sizeof(hdr));
+	pkt += qname;
+	pkt += string(reinterpret_cast<char *>(tail), sizeof(tail));
+	queries.push_back(pkt);
+	return 0;
+}
+
+
+// Every matching RR of a zone file becomes a query. Wildcards are
+// asked for with a few made up names below them; linked RRs are only
+// additional answers, so they are skipped, just like [forward]. So are
+// TTL 1 RRs, as these are answered only once per client.
+int read_zone(const string &file, vector<string> &queries)
+{
+	FILE *f = fopen(file.c_str(), "r");
+	if (!f)
+		return -1;
+
+	char buf[1024], *ptr = nullptr, name[256], ttl[256], type[256];
+	bool linked = 0;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		ptr = buf;
+		while (*ptr == ' ' || *ptr == '\t')
+			++ptr;
+		if (*ptr == ';' || *ptr == '\n')
+			continue;
+		if (*ptr == '@') {
+			linked = 1;
+			continue;
+		}
+		if (sscanf(ptr, "%255[^ \t]%*[ \t]%255[^ \t]%*[ \t]IN%*[ \t]%255[^ \t;\n]", name, ttl, type) != 3)
+			continue;
+		if (linked) {
+			linked = 0;
+			continue;
+		}
+
+		int t = dns_type(type);
+		if (t < 0 || name[0] == '[' || strtoul(ttl, NULL, 10) == 1)
+			continue;
+
+		if (name[0] != '*') {
+			add_query(name, t, queries);
+			continue;
+		}
+
+		const char *suffix = name[1] == '.' ? name + 2 : name + 1;
+		for (int i = 0; i < 8; ++i) {
+			char host[300];
+			snprintf(host, sizeof(host), "wild%d.%s", i, suffix);
+			add_query(host, t, queries);
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+// "name [type]" per line, type defaults to A
+int read_names(const string &file, vector<string> &queries)
+{
+	FILE *f = fopen(file.c_str(), "r");
+	if (!f)
+		return -1;
+
+	char buf[1024], name[256], type[256];
+
+	while (fgets(buf, sizeof(buf), f)) {
+		int n = sscanf(buf, " %255[^ \t\n;#]%*[ \t]%255[^ \t\n;#]", name, type);
+		if (n < 1)
+			continue;
+		int t = n == 2 ? dns_type(type) : 1;
+		if (t < 0) {
+			fprintf(stderr, "Unknown type %s for %s, skipped.\n", type, name);
+			continue;
+		}
+		add_query(name, t, queries);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+// One socket per thread, keeping up to window queries in flight. The
+// query ID is the sequence number mod 2^16 and indexes the send time,
+// so no per query state needs to be looked up. Queries are answered
+// about in order, so expiry walks the oldest ones only.
+void client(const config &cfg, const vector<string> &queries, size_t id, result &res)
+{
+	int fd = socket(cfg.server.ss_family, SOCK_DGRAM, 0);
+	if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr *>(&cfg.server), cfg.slen) < 0) {
+		perror("client: socket");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	int rcvbuf = 1<<22;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	const uint32_t ids = 1<<16;
+	vector<uint64_t> sent_at(ids, 0);	// 0: not in flight
+	uint32_t head = 0, tail = 0;
+	size_t inflight = 0;
+
+	mt19937 rng(cfg.seed + id);
+	char pkt[512], rbuf[4096];
+
+	double rate = cfg.qps/cfg.threads;
+	uint64_t start = now_ns(), stop = start + cfg.duration*1e9, t = start;
+
+	for (;;) {
+		t = now_ns();
+
+		// what remained unanswered for too long is lost
+		while (tail != head) {
+			uint64_t &s = sent_at[tail % ids];
+			if (s != 0) {
+				if (t - s < cfg.timeout)
+					break;
+				s = 0;
+				--inflight;
+				++res.lost;
+			}
+			++tail;
+		}
+
+		if (t >= stop && (inflight == 0 || t >= stop + cfg.timeout))
+			break;
+
+		size_t want = 0;
+		if (t < stop && inflight < cfg.window) {
+			want = cfg.window - inflight;
+			if (rate > 0) {
+				double allowed = rate*(t - start)/1e9 - res.sent;
+				want = allowed < want ? (allowed > 0 ? allowed : 0) : want;
+			}
+		}
+
+		for (; want > 0 && head - tail < ids; --want) {
+			const string &q = queries[rng() % queries.size()];
+			uint16_t qid = htons(head % ids);
+			memcpy(pkt, q.c_str(), q.size());
+			memcpy(pkt, &qid, sizeof(qid));
+
+			// loopback may answer before send() even returns
+			uint64_t s = now_ns();
+			if (send(fd, pkt, q.size(), MSG_DONTWAIT) < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+					++res.send_errors;
+				break;
+			}
+			sent_at[head % ids] = s;
+			++head;
+			++inflight;
+			++res.sent;
+		}
+
+		// wait for answers, or until the next paced query is due
+		pollfd pfd = {fd, POLLIN, 0};
+		int to = rate > 0 && inflight < cfg.window ? 0 : 1;
+		if (inflight > 0 || rate > 0)
+			poll(&pfd, 1, to);
+		else
+			poll(nullptr, 0, 1);
+
+		for (;;) {
+			ssize_t r = recv(fd, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+			if (r < 0)
+				break;
+			uint64_t now = now_ns();
+			if (r < 12) {
+				++res.unexpected;
+				continue;
+			}
+
+			uint16_t qid = 0;
+			memcpy(&qid, rbuf, sizeof(qid));
+			uint64_t &s = sent_at[ntohs(qid)];
+
+			// late ones were already counted as lost
+			if (s == 0 || !(rbuf[2] & 0x80)) {
+				++res.unexpected;
+				continue;
+			}
+
+			uint64_t lat = now - s;
+			s = 0;
+			--inflight;
+			++res.received;
+			++res.rcodes[rbuf[3] & 0xf];
+			res.lat.add(lat);
+			if (lat > res.max)
+				res.max = lat;
+		}
+	}
+
+	close(fd);
+}
+
+
+void usage()
+{
+	printf("\nqdns-bench [-s server(=127.0.0.1)] [-p port(=53)] <-Z zonefile | -f namefile> [-x NXDOMAIN %%(=10)]\n"
+	       "           [-T threads(=1)] [-w window(=64)] [-q qps(=0)] [-d seconds(=10)] [-t timeout ms(=1000)] [-S seed(=1)]\n\n"
+	       "\t-Z\task for every RR of this zone file, and for names below its wildcards\n"
+	       "\t-f\task for the names in this file, one \"name [type]\" per line\n"
+	       "\t-x\tmake this percentage of the queries NXDOMAIN ones\n"
+	       "\t-w\tqueries in flight per thread\n"
+	       "\t-q\tpace the queries to this total rate, 0 to send as fast as answers come in\n"
+	       "\t-t\tcount queries as lost if not answered within this time\n"
+	       "\t-S\tseed of the query order, for repeatable runs\n\n");
+}
+
+}
+
+
+int main(int argc, char **argv)
+{
+	config cfg;
+	string server = "127.0.0.1", zfile = "", nfile = "";
+	unsigned short port = 53;
+	double nx = 10;
+	int c = 0;
+
+	cfg.threads = 1;
+	cfg.window = 64;
+	cfg.duration = 10;
+	cfg.qps = 0;
+	cfg.timeout = 1000;
+	cfg.seed = 1;
+
+	while ((c = getopt(argc, argv, "s:p:Z:f:x:T:w:q:d:t:S:")) != -1) {
+		switch (c) {
+		case 's':
+			server = optarg;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			break;
+		case 'Z':
+			zfile = optarg;
+			break;
+		case 'f':
+			nfile = optarg;
+			break;
+		case 'x':
+			nx = strtod(optarg, NULL);
+			break;
+		case 'T':
+			cfg.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			cfg.window = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			cfg.qps = strtod(optarg, NULL);
+			break;
+		case 'd':
+			cfg.duration = strtod(optarg, NULL);
+			break;
+		case 't':
+			cfg.timeout = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			cfg.seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (zfile.empty() == nfile.empty() || nx < 0 || nx >= 100 || cfg.duration <= 0) {
+		usage();
+		return 1;
+	}
+	if (cfg.threads == 0)
+		cfg.threads = 1;
+	if (cfg.window == 0)
+		cfg.window = 1;
+	if (cfg.window > (1<<15))
+		cfg.window = 1<<15;
+	cfg.timeout *= 1000000;
+
+	memset(&cfg.server, 0, sizeof(cfg.server));
+	sockaddr_in *sin = reinterpret_cast<sockaddr_in *>(&cfg.server);
+	sockaddr_in6 *sin6 = reinterpret_cast<sockaddr_in6 *>(&cfg.server);
+	if (inet_pton(AF_INET, server.c_str(), &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		cfg.slen = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, server.c_str(), &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		cfg.slen = sizeof(*sin6);
+	} else {
+		fprintf(stderr, "Invalid server address %s.\n", server.c_str());
+		return 1;
+	}
+
+	vector<string> queries;
+	if ((zfile.size() ? read_zone(zfile, queries) : read_names(nfile, queries)) < 0) {
+		perror("fopen");
+		return 1;
+	}
+	if (queries.empty()) {
+		fprintf(stderr, "No queries to send.\n");
+		return 1;
+	}
+
+	// names nobody serves, so that they make up nx percent of the mix
+	size_t found = queries.size(), nxn = nx > 0 ? found*nx/(100 - nx) + 1 : 0;
+	for (size_t i = 0; i < nxn; ++i) {
+		char host[64];
+		snprintf(host, sizeof(host), "nx%zu.qdns-bench.invalid", i);
+		add_query(host, 1, queries);
+	}
+
+	printf("\n%zu queries (%zu NXDOMAIN) to %s port %u, %zu thread(s) with %zu in flight each, %.1fs\n",
+	       queries.size(), nxn, server.c_str(), port, cfg.threads, cfg.window, cfg.duration);
+
+	vector<result> results(cfg.threads);
+	vector<thread> clients;
+	for (size_t i = 0; i < cfg.threads; ++i)
+		clients.push_back(thread(client, cref(cfg), cref(queries), i, ref(results[i])));
+	for (auto &t : clients)
+		t.join();
+
+	result total;
+	for (auto &r : results) {
+		total.sent += r.sent;
+		total.received += r.received;
+		total.lost += r.lost;
+		total.unexpected += r.unexpected;
+		total.send_errors += r.send_errors;
+		for (int i = 0; i < 16; ++i)
+			total.rcodes[i] += r.rcodes[i];
+		if (r.max > total.max)
+			total.max = r.max;
+		total.lat.merge(r.lat);
+	}
+
+	double sent = total.sent ? total.sent : 1;
+	printf("\nsent     %12llu\n"
+	       "received %12llu  NOERROR %llu  NXDOMAIN %llu  other %llu\n"
+	       "lost     %12llu  (%.3f%%)\n"
+	       "late     %12llu\n"
+	       "errors   %12llu\n\n"
+	       "QPS      %12.1f\n\n"
+	       "latency  p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n\n",
+	       (unsigned long long)total.sent, (unsigned long long)total.received,
+	       (unsigned long long)total.rcodes[0], (unsigned long long)total.rcodes[3],
+	       (unsigned long long)(total.received - total.rcodes[0] - total.rcodes[3]),
+	       (unsigned long long)total.lost, 100*total.lost/sent,
+	       (unsigned long long)total.unexpected, (unsigned long long)total.send_errors,
+	       total.received/cfg.duration,
+	       total.lat.percentile(0.5)/1e3, total.lat.percentile(0.99)/1e3,
+	       total.lat.percentile(0.999)/1e3, total.max/1e3);
+
+	return 0;
+}
+
@@ -0,0 +1,320 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include "logger.h"
+#include "net-headers.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+int logger::build_error(const string &s)
+{
+	err = "logger::";
+	err += s;
+	if (errno) {
+		err += ": ";
+		err += strerror(errno);
+	}
+	return -1;
+}
+
+
+logger::~logger()
+{
+	shutdown();
+	for (auto r : rings)
+		delete r;
+}
+
+
+void logger::shutdown()
+{
+	stop = 1;
+	if (th.joinable())
+		th.join();
+}
+
+
+int logger::init(size_t nrings, size_t slots, uint32_t smpl)
+{
+	if (slots == 0 || (slots & (slots - 1)) != 0)
+		return build_error("init: ring size must be a power of 2");
+
+	mask = slots - 1;
+	sample = smpl;
+
+	try {
+		for (size_t i = 0; i < nrings; ++i) {
+			rings.push_back(new ring());
+			rings.back()->slots.resize(slots);
+		}
+	} catch (...) {
+		return build_error("init: OOM");
+	}
+
+	return 0;
+}
+
+
+int logger::start()
+{
+	try {
+		th = thread([this]{ drain(); });
+	} catch (...) {
+		return build_error("start: failed to start log thread");
+	}
+	return 0;
+}
+
+
+logger::record *logger::claim(ring *r)
+{
+	size_t h = r->head.load(memory_order_relaxed);
+
+	if (h - r->tail.load(memory_order_acquire) > mask) {
+		r->dropped.fetch_add(1, memory_order_relaxed);
+		return nullptr;
+	}
+	return &r->slots[h & mask];
+}
+
+
+void logger::query(size_t idx, const dns_provider *io, const dns_msg &msg, const query_log &ql)
+{
+	ring *r = rings[idx];
+
+	if (sample == 0 || r->seen++ % sample != 0)
+		return;
+
+	record *rec = claim(r);
+	if (!rec)
+		return;
+
+	if (msg.peer.ss_family == AF_INET6)
+		memcpy(&rec->peer.sin6, &msg.peer, sizeof(rec->peer.sin6));
+	else
+		memcpy(&rec->peer.sin, &msg.peer, sizeof(rec->peer.sin));
+	rec->io = io;
+	rec->flags = ql.flags;
+	rec->qtype = ql.qtype;
+	rec->qname_len = ql.qname_len < sizeof(rec->qname) ? ql.qname_len : sizeof(rec->qname);
+	memcpy(rec->qname, ql.qname, rec->qname_len);
+	rec->field_len = ql.field_len < sizeof(rec->field) ? ql.field_len : sizeof(rec->field);
+	memcpy(rec->field, ql.field, rec->field_len);
+
+	r->head.store(r->head.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+void logger::error(size_t idx, const char *e)
+{
+	ring *r = rings[idx];
+	record *rec = claim(r);
+
+	if (!rec)
+		return;
+
+	rec->io = nullptr;
+	rec->flags = QDNS_LOG_ERROR;
+	rec->qname_len = 0;
+	rec->field_len = strnlen(e, sizeof(rec->field));
+	memcpy(rec->field, e, rec->field_len);
+
+	r->head.store(r->head.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+void logger::drain()
+{
+	string out = "", errs = "";
+	char line[1024];
+	size_t len = 0;
+	query_log ql;
+	vector<uint64_t> reported(rings.size(), 0);
+	auto last = chrono::steady_clock::now();
+
+	for (;;) {
+		bool quit = stop.load();
+
+		out.clear();
+		errs.clear();
+
+		for (auto r : rings) {
+			size_t t = r->tail.load(memory_order_relaxed), h = r->head.load(memory_order_acquire);
+
+			for (; t != h; ++t) {
+				const record &rec = r->slots[t & mask];
+
+				if (rec.flags & QDNS_LOG_ERROR) {
+					errs.append(rec.field, rec.field_len);
+					errs += "\n";
+					continue;
+				}
+
+				ql.qname = rec.qname;
+				ql.qname_len = rec.qname_len;
+				ql.field = rec.field;
+				ql.field_len = rec.field_len;
+				ql.qtype = rec.qtype;
+				ql.flags = rec.flags;
+
+				len = rec.io->sender(&rec.peer.sa, line, sizeof(line));
+				len += snprintf(line + len, sizeof(line) - len, ": ");
+				len += format(ql, line + len, sizeof(line) - len);
+				out.append(line, len);
+				out += "\n";
+			}
+
+			// hand the slots back only after they were formatted
+			r->tail.store(t, memory_order_release);
+		}
+
+		// tell about lost records, at most once a second
+		auto now = chrono::steady_clock::now();
+		if (now - last >= chrono::seconds(1)) {
+			for (size_t i = 0; i < rings.size(); ++i) {
+				uint64_t d = rings[i]->dropped.load(memory_order_relaxed);
+				if (d == reported[i])
+					continue;
+				snprintf(line, sizeof(line), "worker %zu: %llu log records dropped\n", i,
+				         (unsigned long long)(d - reported[i]));
+				errs += line;
+				reported[i] = d;
+			}
+			last = now;
+		}
+
+		if (errs.size())
+			cerr<<errs<<flush;
+		if (out.size())
+			cout<<out<<flush;
+		else if (quit)
+			break;
+		else
+			this_thread::sleep_for(chrono::milliseconds(1));
+	}
+}
+
+
+// "A? www.example.com. -> 1.2.3.4" into buf, returns its length
+size_t logger::format(const query_log &ql, char *buf, size_t len)
+{
+	using net_headers::dns_type;
+
+	if (len == 0)
+		return 0;
+
+	if (ql.flags & QDNS_LOG_INVALID) {
+		snprintf(buf, len, "invalid query");
+		return strlen(buf);
+	}
+
+	const char *t = nullptr;
+
+	switch (ql.qtype) {
+	case dns_type::A:
+		t = "A";
+		break;
+	case dns_type::AAAA:
+		t = "AAAA";
+		break;
+	case dns_type::MX:
+		t = "MX";
+		break;
+	case dns_type::CNAME:
+		t = "CNAME";
+		break;
+	case dns_type::NS:
+		t = "NS";
+		break;
+	case dns_type::PTR:
+		t = "PTR";
+		break;
+	case dns_type::SRV:
+		t = "SRV";
+		break;
+	case dns_type::TXT:
+		t = "TXT";
+		break;
+	}
+
+	size_t n = 0;
+	int r = 0;
+
+	if (t)
+		r = snprintf(buf, len, "%s? ", t);
+	else
+		r = snprintf(buf, len, "%d? ", ql.qtype);
+	n = r < (int)len ? r : len - 1;
+
+	// the wire format QNAME was checked by parse_packet(); only whole
+	// labels are written, each with its dot and room left for the 0
+	for (size_t i = 0; i < ql.qname_len && ql.qname[i] != 0;) {
+		uint8_t l = ql.qname[i++];
+		if (n + l + 2 > len)
+			break;
+		for (; l > 0 && i < ql.qname_len; --l)
+			buf[n++] = ql.qname[i++];
+		buf[n++] = '.';
+	}
+	buf[n] = 0;
+
+	const char *result = "";
+	if (ql.flags & QDNS_LOG_NXDOMAIN)
+		result = "NDXOMAIN ";
+	if (ql.flags & QDNS_LOG_RESEND)
+		r = snprintf(buf + n, len - n, " -> %s(resend)", result);
+	else if (ql.flags & QDNS_LOG_NOFWD)
+		r = snprintf(buf + n, len - n, " -> %sno [forward], (nosend)", result);
+	else if (ql.flags & QDNS_LOG_NOSEND)
+		r = snprintf(buf + n, len - n, " -> %s(nosend)", result);
+	else if (ql.flags & QDNS_LOG_ONCE)
+		r = snprintf(buf + n, len - n, " -> %s(once, nosend)", result);
+	else if (ql.flags & QDNS_LOG_RRL_DROP)
+		r = snprintf(buf + n, len - n, " -> %s(rate limited, nosend)", result);
+	else if (ql.flags & QDNS_LOG_RRL_SLIP)
+		r = snprintf(buf + n, len - n, " -> %s(rate limited, truncated)", result);
+	else if (ql.flags & QDNS_LOG_BADVERS)
+		r = snprintf(buf + n, len - n, " -> BADVERS");
+	else if (ql.flags & QDNS_LOG_TOOBIG)
+		r = snprintf(buf + n, len - n, " -> %sreply too large, (nosend)", result);
+	else if (ql.flags & QDNS_LOG_TC)
+		r = snprintf(buf + n, len - n, " -> %s%.*s (truncated)", result, (int)ql.field_len, ql.field);
+	else
+		r = snprintf(buf + n, len - n, " -> %s%.*s", result, (int)ql.field_len, ql.field);
+
+	n += r;
+	return n < len ? n : len - 1;
+}
+
+
+} // namespace
+
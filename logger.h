@@ -0,0 +1,146 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef qdns_logger_h
+#define qdns_logger_h
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <netinet/in.h>
+#include "provider.h"
+
+
+namespace qdns {
+
+
+typedef enum {
+	QDNS_LOG_INVALID	= 0x01,
+	QDNS_LOG_NXDOMAIN	= 0x02,
+	QDNS_LOG_RESEND		= 0x04,
+	QDNS_LOG_NOSEND		= 0x08,
+	QDNS_LOG_ONCE		= 0x10,
+	QDNS_LOG_NOFWD		= 0x20,
+	QDNS_LOG_TOOBIG		= 0x40,
+	QDNS_LOG_ERROR		= 0x80,
+	QDNS_LOG_WILD		= 0x100,	// only counted, not printed
+	QDNS_LOG_EDNS		= 0x200,	// same
+	QDNS_LOG_BADVERS	= 0x400,
+	QDNS_LOG_TC		= 0x800,
+	QDNS_LOG_RRL_DROP	= 0x1000,
+	QDNS_LOG_RRL_SLIP	= 0x2000
+} log_flags;
+
+
+// What parse_packet() did with a query. Only turned into text when
+// printed; qname points into the query and field into the zone.
+struct query_log {
+	const char *qname, *field;
+	size_t qname_len, field_len;
+	uint16_t qtype;		// host order
+	uint32_t flags;
+};
+
+
+// Query log that never blocks the workers. Each worker owns one
+// single-producer/single-consumer ring and copies a fixed size record into
+// it; a separate thread drains all rings, formats the text and writes it
+// out. If a ring is full, the record is dropped and counted.
+class logger {
+
+	struct record {
+		union {
+			sockaddr sa;
+			sockaddr_in sin;
+			sockaddr_in6 sin6;
+		} peer;
+		const dns_provider *io;
+		uint32_t flags;
+		uint16_t qtype;
+		uint8_t qname_len, field_len;
+		char qname[255], field[255];	// field also holds error texts
+	};
+
+	// head and tail on their own cache lines, so worker and
+	// log thread do not keep stealing them from each other
+	struct ring {
+		std::atomic<size_t> head;		// written by worker
+		char pad1[64 - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> tail;		// written by log thread
+		char pad2[64 - sizeof(std::atomic<size_t>)];
+		std::atomic<uint64_t> dropped;
+		uint64_t seen;				// worker only, for sampling
+		std::vector<record> slots;
+
+		ring() : head(0), tail(0), dropped(0), seen(0)
+		{}
+	};
+
+	std::vector<ring *> rings;
+	size_t mask;
+	uint32_t sample;
+
+	std::thread th;
+	std::atomic<bool> stop;
+
+	std::string err;
+
+	void drain();
+
+	record *claim(ring *);
+
+	int build_error(const std::string &);
+
+public:
+
+	logger() : mask(0), sample(1), stop(0), err("")
+	{
+	}
+
+	virtual ~logger();
+
+	const char *why()
+	{
+		return err.c_str();
+	}
+
+	// nrings workers, slots (a power of 2) records per worker,
+	// log every sample'th query (0: log errors only)
+	int init(size_t nrings, size_t slots, uint32_t sample);
+
+	int start();
+
+	// write out what is still queued and end the log thread
+	void shutdown();
+
+	// worker side, never blocks
+	void query(size_t, const dns_provider *, const dns_msg &, const query_log &);
+
+	void error(size_t, const char *);
+
+	static size_t format(const query_log &, char *, size_t);
+};
+
+
+} // namespace
+
+#endif
+
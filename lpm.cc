@@ -0,0 +1,201 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include "lpm.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+void prefix_table::sync()
+{
+	v.top = top.empty() ? nullptr : top.data();
+	v.nodes = nodes.data();
+	v.leaves = leaves.data();
+}
+
+
+void prefix_table::clear()
+{
+	prefixes.clear();
+	top.clear();
+	nodes.clear();
+	leaves.clear();
+	sync();
+}
+
+
+int prefix_table::add(const uint8_t *addr, size_t alen, unsigned len, uint16_t val)
+{
+	if ((alen != 4 && alen != 16) || len > 8*alen)
+		return -1;
+
+	uint8_t a[16];
+	memset(a, 0, sizeof(a));
+	memcpy(a, addr, alen);
+
+	prefix p;
+	memset(&p, 0, sizeof(p));
+	for (int i = 0; i < 8; ++i) {
+		p.hi = (p.hi<<8) | a[i];
+		p.lo = (p.lo<<8) | a[i + 8];
+	}
+	p.hi &= len >= 64 ? ~0ULL : (len == 0 ? 0 : ~0ULL<<(64 - len));
+	p.lo &= len >= 128 ? ~0ULL : (len <= 64 ? 0 : ~0ULL<<(128 - len));
+	p.seq = prefixes.size();
+	p.val = val;
+	p.len = len;
+
+	try {
+		prefixes.push_back(p);
+	} catch (...) {
+		return -1;
+	}
+	return 0;
+}
+
+
+// The 2^width entries of a node at bit off, for the prefixes in
+// [b, e), which are longer than off and sorted by address, then by
+// length: the value of the longest prefix that covers each entry, def
+// if none does, and the range of the prefixes that go deeper than each
+// entry, empty if none. Of nested prefixes the shorter one comes first,
+// so painting them in order leaves the longest on each entry.
+void prefix_table::split(uint32_t b, uint32_t e, unsigned off, unsigned width, uint16_t def,
+                         uint16_t *val, uint32_t *sub) const
+{
+	size_t n = size_t(1)<<width;
+
+	for (size_t j = 0; j < n; ++j) {
+		val[j] = def;
+		sub[2*j] = sub[2*j + 1] = 0;
+	}
+
+	for (uint32_t i = b; i < e; ++i) {
+		const prefix &p = prefixes[i];
+		size_t j = bits(p.hi, p.lo, off, width);
+		if (p.len <= off + width) {
+			// j has the host bits clear, so the prefix covers a run of entries
+			size_t span = size_t(1)<<(off + width - p.len);
+			for (size_t k = j; k < j + span; ++k)
+				val[k] = p.val;
+		} else {
+			if (sub[2*j] == sub[2*j + 1])
+				sub[2*j] = i;
+			sub[2*j + 1] = i + 1;
+		}
+	}
+}
+
+
+// node idx for the prefixes in [b, e), below bit off; its children are
+// appended to nodes in a row, its leaf runs to leaves
+int prefix_table::build_node(uint32_t b, uint32_t e, unsigned off, uint16_t def, uint32_t idx)
+{
+	enum { n = 1<<stride };
+	uint16_t val[n];
+	uint32_t sub[2*n];
+	split(b, e, off, stride, def, val, sub);
+
+	node nd;
+	memset(&nd, 0, sizeof(nd));
+	nd.base0 = leaves.size();
+	nd.base1 = nodes.size();
+
+	size_t children = 0;
+	for (unsigned i = 0; i < n; ++i) {
+		if (sub[2*i] != sub[2*i + 1]) {
+			nd.vector |= 1ULL<<i;
+			++children;
+		} else if (nd.leafvec == 0 || val[i] != leaves.back()) {
+			nd.leafvec |= 1ULL<<i;
+			leaves.push_back(val[i]);
+		}
+	}
+
+	if (nodes.size() + children >= leaf || leaves.size() > 0xffffffff)
+		return -1;
+	nodes.resize(nodes.size() + children);
+	nodes[idx] = nd;
+
+	for (unsigned i = 0, c = 0; i < n; ++i) {
+		if (sub[2*i] != sub[2*i + 1] && build_node(sub[2*i], sub[2*i + 1], off + stride, val[i], nd.base1 + c++) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+int prefix_table::build()
+{
+	top.clear();
+	nodes.clear();
+	leaves.clear();
+	sync();
+
+	if (prefixes.empty())
+		return 0;
+	if (prefixes.size() > 0xffffffff)
+		return -1;
+
+	try {
+		sort(prefixes.begin(), prefixes.end(), [](const prefix &a, const prefix &b) {
+			if (a.hi != b.hi)
+				return a.hi < b.hi;
+			if (a.lo != b.lo)
+				return a.lo < b.lo;
+			if (a.len != b.len)
+				return a.len < b.len;
+			return a.seq < b.seq;
+		});
+
+		vector<uint16_t> val(top_size);
+		vector<uint32_t> sub(2*top_size);
+		split(0, prefixes.size(), 0, top_bits, 0, val.data(), sub.data());
+
+		top.resize(top_size);
+		for (size_t i = 0; i < top_size; ++i) {
+			if (sub[2*i] == sub[2*i + 1]) {
+				top[i] = leaf | val[i];
+				continue;
+			}
+			top[i] = nodes.size();
+			nodes.push_back(node());
+			if (build_node(sub[2*i], sub[2*i + 1], top_bits, val[i], top[i]) < 0) {
+				clear();
+				return -1;
+			}
+		}
+	} catch (...) {
+		clear();
+		return -1;
+	}
+
+	sync();
+	return 0;
+}
+
+
+} // namespace
@@ -0,0 +1,148 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef qdns_lpm_h
+#define qdns_lpm_h
+
+#include <vector>
+#include <cstdint>
+
+
+namespace qdns {
+
+
+// Longest prefix match of client addresses to a 16 bit value, such as
+// the view a client gets. Addresses are 128 bit keys, hi and lo, with
+// IPv4 addresses in the upper 32 bits of hi, so one table type serves
+// both families.
+//
+// Laid out like a poptrie: a direct table for the first 16 bits, then
+// nodes of 6 bit strides. A node has no pointers, just two bitmaps of
+// its 64 entries: which ones are child nodes, kept in a row from base1,
+// and where runs of equal leaves start, each run kept once from base0.
+// A lookup takes the popcount of the bits below an entry to find it, so
+// it is a few dependent loads of 24 byte nodes, and the run compression
+// keeps a few hundred thousand IPv4 networks in a few MB. Like the
+// zone's indexes, it is built once and then only read.
+class prefix_table {
+public:
+
+	struct node {
+		uint64_t vector;	// bit i: entry i is a child node
+		uint64_t leafvec;	// bit i: a run of leaves starts at entry i
+		uint32_t base0;		// first leaf, into leaves
+		uint32_t base1;		// first child, into nodes
+	};
+
+	enum : uint32_t {
+		top_bits = 16,
+		top_size = 1<<top_bits,
+		stride = 6,
+		leaf = 0x80000000	// a top entry that is a value, not a node
+	};
+
+private:
+
+	struct prefix {
+		uint64_t hi, lo;
+		uint32_t seq;		// of equal ones, the last added wins
+		uint16_t val;
+		uint8_t len;
+	};
+
+	std::vector<prefix> prefixes;
+
+	std::vector<uint32_t> top;
+	std::vector<node> nodes;
+	std::vector<uint16_t> leaves;
+
+	// What lookups use: either the vectors above or a mapped zone image
+	struct {
+		const uint32_t *top;
+		const node *nodes;
+		const uint16_t *leaves;
+	} v;
+
+	void split(uint32_t, uint32_t, unsigned, unsigned, uint16_t, uint16_t *, uint32_t *) const;
+
+	int build_node(uint32_t, uint32_t, unsigned, uint16_t, uint32_t);
+
+	void sync();
+
+	friend class zone;
+
+public:
+
+	prefix_table()
+	{
+		clear();
+	}
+
+	void clear();
+
+	// the width bits of the key from bit off on, counted from the top
+	static unsigned bits(uint64_t hi, uint64_t lo, unsigned off, unsigned width)
+	{
+		uint64_t w = 0;
+
+		if (off == 0)
+			w = hi;
+		else if (off < 64)
+			w = (hi<<off) | (lo>>(64 - off));
+		else if (off < 128)
+			w = lo<<(off - 64);
+		return w>>(64 - width);
+	}
+
+	// addr is alen bytes in network order, 4 or 16; the host bits
+	// past len are ignored
+	int add(const uint8_t *addr, size_t alen, unsigned len, uint16_t val);
+
+	// the table of all prefixes added so far; lookups before the first
+	// build() find nothing
+	int build();
+
+	bool empty() const
+	{
+		return v.top == nullptr;
+	}
+
+	// value of the longest prefix that holds the key, 0 if none
+	uint16_t find(uint64_t hi, uint64_t lo) const
+	{
+		if (!v.top)
+			return 0;
+
+		uint32_t e = v.top[hi>>(64 - top_bits)];
+		for (unsigned off = top_bits; (e & leaf) == 0; off += stride) {
+			const node &n = v.nodes[e];
+			unsigned i = bits(hi, lo, off, stride);
+			uint64_t upto = ~0ULL>>(63 - i);
+			if ((n.vector & (1ULL<<i)) == 0)
+				return v.leaves[n.base0 + __builtin_popcountll(n.leafvec & upto) - 1];
+			e = n.base1 + __builtin_popcountll(n.vector & upto) - 1;
+		}
+		return e & 0xffff;
+	}
+};
+
+
+} // namespace
+
+#endif
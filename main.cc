@@ -29,16 +29,41 @@ using namespace std;
 
 void usage()
 {
-	cout<<"\nqdns [-Z zonefile] [-X] [-6] [-l local IPv4/6] [-p local port(=53)] [-M dev] [-R (Attention!)]\n\n"
+	cout<<"\nqdns [-Z zonefile] [-X] [-6] [-l local IPv4/6] [-p local port(=53)] [-U] [-M dev [-P] [-F mode]] [-R (Attention!)] [-B batch] [-T threads] [-L n]\n"
+	    <<"     [-t [-m conns] [-i seconds]] [-O n] [-E seconds] [-N v4bits[/v6bits]] [-S socket]\n"
+	    <<"     [-a rate [-n rate] [-W seconds] [-s slip] [-K v4bits[/v6bits]]]\n"
+	    <<"qdns -C zonefile -o image\n"
+	    <<"qdns [-Z zonefile] -r capture [-w capture] [-f filter] [-X] [-R] [-B batch] [-L n] [-S socket]\n\n"
 	    <<"\t-X\tdo not send NXDOMAIN if no RR was found in zonefile\n"
 	    <<"\t-M\trather than listening on (p)ort, capture on this device and also answer queries not for us\n"
+	    <<"\t-P\tcapture through an AF_PACKET mmap ring rather than libpcap in -M mode (Linux only)\n"
+	    <<"\t-F\thow -P captures of several -T threads share the traffic: hash (by flow) or cpu (default=hash)\n"
 	    <<"\t-R\tresend query rather than sending NXDOMAIN; only useful on a router with 2 NICs and a DROP FORWARD policy\n"
 	    <<"\t\twhere resend is not seen via input NIC again! otherwise it recursively loops and spams peer with the same DNS query\n"
-	    <<"\t-f\talso apply this filter when using -M mode\n"
+	    <<"\t-f\talso apply this filter when using -M or -r mode\n"
 	    <<"\t-6\tbind to v6 address or use IP6 capture when -M mode\n"
-	    <<"\t-Z\tuse this zonefile (default=stdin)\n"
+	    <<"\t-Z\tuse this zonefile or zone image (default=stdin); SIGHUP loads it again\n"
+	    <<"\t-r\treplay the queries of this pcap file as fast as possible, rather than using the network\n"
+	    <<"\t-w\twrite the replies to the replayed queries into this pcap file\n"
+	    <<"\t-C\tcompile this zonefile into a zone image that -Z maps at startup; needs -o\n"
 	    <<"\t-l\tbind to this address\n"
-	    <<"\t-p\tbind to this port\n\n";
+	    <<"\t-p\tbind to this port\n"
+	    <<"\t-U\tdrive the socket through io_uring if the kernel supports it (Linux only)\n"
+	    <<"\t-t\talso answer over TCP on the same address and port, in a thread of its own (Linux only)\n"
+	    <<"\t-m\tserve at most this many TCP connections at once (default=256)\n"
+	    <<"\t-i\tclose TCP connections that sent nothing for this many seconds (default=10)\n"
+	    <<"\t-B\treceive and answer up to this many queries per syscall (default=32)\n"
+	    <<"\t-T\trun this many worker threads, each with its own socket or capture (default=1)\n"
+	    <<"\t-L\tlog only every n-th query, 0 to log errors only (default=1)\n"
+	    <<"\t-O\tremember up to this many clients per thread that got their TTL=1 answer (default=65536)\n"
+	    <<"\t-E\tanswer such a client again after this many seconds (default=3600)\n"
+	    <<"\t-N\tanswer TTL=1 RRs once per network of these prefix lengths, rather than per client (default=32/128)\n"
+	    <<"\t-S\tserve counters and latencies to whoever connects to this Unix socket\n"
+	    <<"\t-a\trate limit UDP answers to this many per second, per client network and thread (default=off)\n"
+	    <<"\t-n\tsame for NXDOMAIN answers (default=as -a)\n"
+	    <<"\t-W\tkeep limiting a network until it was quiet for this many seconds, at most 3600 (default=15)\n"
+	    <<"\t-s\tsend every n-th rate limited answer truncated, so clients may retry over TCP; 0 drops all, at most 255 (default=2)\n"
+	    <<"\t-K\tprefix lengths of a client network for rate limiting (default=24/56)\n\n";
 }
 
 
@@ -53,8 +78,9 @@ int main(int argc, char **argv)
 	args["laddr"] = "0.0.0.0";
 	args["nxdomain"] = "1";
 	args["zone"] = "/dev/stdin";
+	args["batch"] = "32";
 
-	while ((c = getopt(argc, argv, "l:p:M:6XRZ:f:")) != -1) {
+	while ((c = getopt(argc, argv, "l:p:UM:PF:6XRZ:f:B:T:L:C:o:r:w:O:E:N:S:tm:i:a:n:W:s:K:")) != -1) {
 		switch (c) {
 		case 'f':
 			args["filter"] = string(optarg);
@@ -66,10 +92,19 @@ int main(int argc, char **argv)
 		case 'p':
 			args["lport"] = string(optarg);
 			break;
+		case 'U':
+			args["uring"] = "1";
+			break;
 		case 'M':
 			args["mon"] = string(optarg);	// device
 			args.erase("laddr");
 			break;
+		case 'P':
+			args["ring"] = "1";
+			break;
+		case 'F':
+			args["fanout_mode"] = string(optarg);
+			break;
 		case '6':
 			args["6"] = "1";
 			if (!laddr_set && args.count("mon") == 0)
@@ -84,6 +119,64 @@ int main(int argc, char **argv)
 		case 'Z':
 			args["zone"] = string(optarg);
 			break;
+		case 'B':
+			args["batch"] = string(optarg);
+			break;
+		case 'T':
+			args["threads"] = string(optarg);
+			break;
+		case 'L':
+			args["logsample"] = string(optarg);
+			break;
+		case 'C':
+			args["compile"] = string(optarg);
+			break;
+		case 'o':
+			args["out"] = string(optarg);
+			break;
+		case 'r':
+			args["pcap_in"] = string(optarg);
+			args.erase("laddr");
+			break;
+		case 'w':
+			args["pcap_out"] = string(optarg);
+			break;
+		case 'O':
+			args["once_size"] = string(optarg);
+			break;
+		case 'E':
+			args["once_expire"] = string(optarg);
+			break;
+		case 'N':
+			args["once_prefix"] = string(optarg);
+			break;
+		case 'S':
+			args["stats"] = string(optarg);
+			break;
+		case 't':
+			args["tcp"] = "1";
+			break;
+		case 'm':
+			args["tcp_max"] = string(optarg);
+			break;
+		case 'i':
+			args["tcp_idle"] = string(optarg);
+			break;
+		case 'a':
+			args["rrl_rate"] = string(optarg);
+			break;
+		case 'n':
+			args["rrl_nxrate"] = string(optarg);
+			break;
+		case 'W':
+			args["rrl_window"] = string(optarg);
+			break;
+		case 's':
+			args["rrl_slip"] = string(optarg);
+			break;
+		case 'K':
+			args["rrl_prefix"] = string(optarg);
+			break;
 		default:
 			usage();
 			return 1;
@@ -93,6 +186,23 @@ int main(int argc, char **argv)
 
 	qdns::qdns *quantum_dns = new (nothrow) qdns::qdns();
 
+	// compile only, no sockets needed
+	if (args.count("compile") > 0) {
+		if (args.count("out") == 0) {
+			usage();
+			delete quantum_dns;
+			return 1;
+		}
+		if (quantum_dns->parse_zone(args["compile"]) < 0 || quantum_dns->save_zone(args["out"]) < 0) {
+			cerr<<quantum_dns->why()<<endl;
+			delete quantum_dns;
+			return -1;
+		}
+		cout<<"Wrote zone image "<<args["out"]<<endl;
+		delete quantum_dns;
+		return 0;
+	}
+
 	if (quantum_dns->init(args) < 0) {
 		cerr<<quantum_dns->why()<<endl;
 		delete quantum_dns;
@@ -18,6 +18,8 @@
  */
 
 #include <string>
+#include <cstring>
+#include <cstdint>
 
 namespace qdns {
 
@@ -111,5 +113,33 @@ int qname2host(const string &msg, string &result)
 }
 
 
+// The sum is done in host order on 16bit words as they are in memory,
+// which yields the network order result when stored back the same way
+uint32_t cksum_add(uint32_t sum, const void *buf, size_t len)
+{
+	const unsigned char *ptr = reinterpret_cast<const unsigned char *>(buf);
+	uint16_t w = 0;
+
+	for (; len > 1; len -= 2, ptr += 2) {
+		memcpy(&w, ptr, sizeof(w));
+		sum += w;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, ptr, 1);
+		sum += w;
+	}
+	return sum;
+}
+
+
+uint16_t cksum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+
 } // namespace
 
@@ -21,6 +21,8 @@
 #define qdns_misc_h
 
 #include <string>
+#include <cstddef>
+#include <cstdint>
 
 namespace qdns {
 
@@ -28,6 +30,12 @@ int host2qname(const std::string &, std::string &);
 
 int qname2host(const std::string &, std::string &);
 
+// RFC 1071 internet checksum: sum up any number of even sized chunks
+// (only the last one may be odd), then fold into the final field value
+uint32_t cksum_add(uint32_t, const void *, size_t);
+
+uint16_t cksum_fold(uint32_t);
+
 
 }
 
@@ -0,0 +1,165 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <netinet/in.h>
+#include "once.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+uint32_t once_set::hash(const key &k)
+{
+	// the three words of the key, with a murmur style finalizer
+	uint64_t w[3], h = 0x9e3779b97f4a7c15ULL;
+	memcpy(w, &k, sizeof(w));
+
+	for (int i = 0; i < 3; ++i) {
+		h = (h ^ w[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h>>32;
+	}
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h>>29;
+	return h;
+}
+
+
+int once_set::init(size_t capacity, uint32_t exp, unsigned p4, unsigned p6)
+{
+	if (capacity == 0)
+		capacity = 1;
+
+	size_t n = 1;
+	while (n < 2*capacity)
+		n <<= 1;
+
+	try {
+		entries.assign(capacity, entry());
+		slots.assign(n, 0);
+	} catch (...) {
+		return -1;
+	}
+
+	mask = n - 1;
+	head = used = 0;
+	expire = exp;
+	prefix4 = p4 < 32 ? p4 : 32;
+	prefix6 = p6 < 128 ? p6 : 128;
+	return 0;
+}
+
+
+void once_set::clear()
+{
+	slots.assign(slots.size(), 0);
+	head = used = 0;
+}
+
+
+// Take the oldest entry out of the table. The ones probed past its slot
+// are shifted back into the hole, so lookups never need tombstones.
+void once_set::drop_oldest()
+{
+	uint32_t idx = oldest();
+	size_t i = entries[idx].hash & mask, j = 0;
+
+	while (slots[i] != idx + 1)
+		i = (i + 1) & mask;
+
+	for (j = (i + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+		size_t home = entries[slots[j] - 1].hash & mask;
+
+		// may move to i if that is not before its home slot
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i] = 0;
+	--used;
+}
+
+
+bool once_set::insert(const sockaddr_storage &peer, bool with_port, uint32_t now)
+{
+	if (slots.empty())
+		return 1;
+
+	key k;
+	memset(&k, 0, sizeof(k));
+	k.family = peer.ss_family;
+
+	unsigned bits = 0, full = 0;
+	if (peer.ss_family == AF_INET) {
+		const sockaddr_in *sin = reinterpret_cast<const sockaddr_in *>(&peer);
+		memcpy(k.addr, &sin->sin_addr, sizeof(sin->sin_addr));
+		k.port = sin->sin_port;
+		bits = prefix4;
+		full = 32;
+	} else {
+		const sockaddr_in6 *sin6 = reinterpret_cast<const sockaddr_in6 *>(&peer);
+		memcpy(k.addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+		k.port = sin6->sin6_port;
+		bits = prefix6;
+		full = 128;
+	}
+
+	// a port only tells clients apart, not networks
+	if (!with_port || bits < full)
+		k.port = 0;
+	for (unsigned i = bits; i < full; ++i)
+		k.addr[i/8] &= ~(0x80>>(i % 8));
+
+	// forget the clients that have waited long enough
+	while (used > 0 && now - entries[oldest()].added >= expire)
+		drop_oldest();
+
+	uint32_t h = hash(k);
+	for (size_t i = h & mask; slots[i] != 0; i = (i + 1) & mask) {
+		const entry &e = entries[slots[i] - 1];
+		if (e.hash == h && memcmp(&e.k, &k, sizeof(k)) == 0)
+			return 0;
+	}
+
+	if (used == entries.size())
+		drop_oldest();
+
+	entry &e = entries[head];
+	e.k = k;
+	e.hash = h;
+	e.added = now;
+
+	size_t i = h & mask;
+	while (slots[i] != 0)
+		i = (i + 1) & mask;
+	slots[i] = head + 1;
+
+	head = (head + 1) % entries.size();
+	++used;
+	return 1;
+}
+
+
+} // namespace
+
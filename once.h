@@ -0,0 +1,94 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef qdns_once_h
+#define qdns_once_h
+
+#include <vector>
+#include <cstdint>
+#include <sys/socket.h>
+
+
+namespace qdns {
+
+
+// The clients that already got their answer to a TTL 1 ("once") RR.
+// Clients are keyed by their binary address, masked to a prefix, and
+// the port if asked for. Memory is fixed at init(): the entries are a
+// ring in the order they were added, indexed by an open-addressing
+// table of twice the size. As every entry lives equally long, expiry
+// just pops the oldest end of the ring; when the ring is full, the
+// oldest entry is forgotten early.
+class once_set {
+
+	struct key {
+		uint8_t addr[16];
+		uint16_t port, family;
+		uint32_t unused;
+	};
+
+	struct entry {
+		key k;
+		uint32_t hash;
+		uint32_t added;
+	};
+
+	std::vector<entry> entries;
+	std::vector<uint32_t> slots;	// entry index + 1, 0 means empty slot
+	size_t mask, head, used;
+
+	uint32_t expire;
+	unsigned prefix4, prefix6;
+
+	static uint32_t hash(const key &);
+
+	// ring position of the oldest entry
+	size_t oldest() const
+	{
+		return (head + entries.size() - used) % entries.size();
+	}
+
+	void drop_oldest();
+
+public:
+
+	once_set() : mask(0), head(0), used(0), expire(0), prefix4(32), prefix6(128)
+	{
+	}
+
+	// room for capacity clients, each remembered for expire seconds
+	int init(size_t capacity, uint32_t expire, unsigned prefix4, unsigned prefix6);
+
+	void clear();
+
+	// Whether peer was not seen within the last expire seconds, in
+	// which case it is remembered from now on. now is in seconds.
+	bool insert(const sockaddr_storage &peer, bool with_port, uint32_t now);
+
+	size_t size() const
+	{
+		return used;
+	}
+};
+
+
+} // namespace
+
+#endif
+
@@ -0,0 +1,395 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <iostream>
+#include <pcap.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+
+#include "provider.h"
+#include "misc.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+static double now()
+{
+	using namespace std::chrono;
+	return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+pcap_file_provider::~pcap_file_provider()
+{
+	if (eof) {
+		cout<<"Replayed "<<queries<<" queries in "<<uint64_t(elapsed*1000)<<"ms ("
+		    <<uint64_t(elapsed > 0 ? queries/elapsed : 0)<<" queries/s), "<<replies<<" replies.\n";
+	}
+
+	if (out)
+		pcap_dump_close(out);
+	if (dead)
+		pcap_close(dead);
+	if (in)
+		pcap_close(in);
+}
+
+
+int pcap_file_provider::init(const map<string, string> &args)
+{
+	string f = "udp and dst port 53";
+
+	auto it = args.find("pcap_in");
+	if (it == args.end())
+		return build_error("init: no capture file to read");
+
+	char ebuf[PCAP_ERRBUF_SIZE];
+	memset(ebuf, 0, sizeof(ebuf));
+	if (!(in = pcap_open_offline(it->second.c_str(), ebuf)))
+		return build_error(string("init: pcap_open_offline: ") + ebuf);
+
+	switch (linktype = pcap_datalink(in)) {
+	case DLT_EN10MB:
+	case DLT_LINUX_SLL:
+#ifdef DLT_LINUX_SLL2
+	case DLT_LINUX_SLL2:
+#endif
+	case DLT_NULL:
+#ifdef DLT_LOOP
+	case DLT_LOOP:
+#endif
+	case DLT_RAW:
+		break;
+	default:
+		return build_error("init: unsupported link type of " + it->second);
+	}
+
+	if ((it = args.find("filter")) != args.end())
+		f = it->second;
+
+	bpf_program bpf;
+	if (pcap_compile(in, &bpf, f.c_str(), 1, PCAP_NETMASK_UNKNOWN) < 0)
+		return build_error(string("init: filter: ") + pcap_geterr(in));
+	int r = pcap_setfilter(in, &bpf);
+	pcap_freecode(&bpf);
+	if (r < 0)
+		return build_error(string("init: pcap_setfilter: ") + pcap_geterr(in));
+
+	// without an output file, replies are only counted
+	if ((it = args.find("pcap_out")) != args.end()) {
+		if (!(dead = pcap_open_dead(DLT_RAW, 65535)))
+			return build_error("init: pcap_open_dead");
+		if (!(out = pcap_dump_open(dead, it->second.c_str())))
+			return build_error(string("init: pcap_dump_open: ") + pcap_geterr(dead));
+
+		try {
+			pkt.resize(sizeof(ip6_hdr) + sizeof(udphdr) + dns_max_reply);
+		} catch (...) {
+			return build_error("init: OOM");
+		}
+	}
+
+	return 0;
+}
+
+
+// A captured frame -> msg. Everything that is not a complete UDP
+// datagram is skipped; which ones are queries is up to the filter.
+bool pcap_file_provider::parse(const unsigned char *frame, size_t len, dns_msg &msg)
+{
+	uint16_t proto = 0;
+	size_t off = 0;
+
+	// find the IP header and, where the link layer tells, its version
+	switch (linktype) {
+	case DLT_EN10MB:
+		if (len < 14)
+			return 0;
+		proto = (frame[12]<<8)|frame[13];
+		off = 14;
+		while ((proto == 0x8100 || proto == 0x88a8) && len >= off + 4) {
+			proto = (frame[off + 2]<<8)|frame[off + 3];
+			off += 4;
+		}
+		break;
+	case DLT_LINUX_SLL:
+		if (len < 16)
+			return 0;
+		proto = (frame[14]<<8)|frame[15];
+		off = 16;
+		break;
+#ifdef DLT_LINUX_SLL2
+	case DLT_LINUX_SLL2:
+		if (len < 20)
+			return 0;
+		proto = (frame[0]<<8)|frame[1];
+		off = 20;
+		break;
+#endif
+	case DLT_NULL:
+#ifdef DLT_LOOP
+	case DLT_LOOP:
+#endif
+		off = 4;
+		break;
+	default:
+		break;
+	}
+
+	if (len <= off)
+		return 0;
+	const unsigned char *ptr = frame + off;
+	len -= off;
+
+	// no ethertype: go by the IP version
+	if (proto == 0)
+		proto = (ptr[0]>>4) == 6 ? 0x86dd : 0x0800;
+
+	if (proto == 0x0800) {
+		iphdr ip;
+		if (len < sizeof(ip))
+			return 0;
+		memcpy(&ip, ptr, sizeof(ip));
+
+		size_t hlen = ip.ihl * 4, tlen = ntohs(ip.tot_len);
+		if (ip.version != 4 || ip.protocol != IPPROTO_UDP || hlen < sizeof(ip))
+			return 0;
+		if (tlen > len || tlen < hlen + sizeof(udphdr))
+			return 0;
+		if (ntohs(ip.frag_off) & (IP_MF|IP_OFFMASK))
+			return 0;
+		ptr += hlen;
+		len = tlen - hlen;
+
+		sockaddr_in *from = reinterpret_cast<sockaddr_in *>(&msg.peer);
+		sockaddr_in *to = reinterpret_cast<sockaddr_in *>(&msg.local);
+		from->sin_family = to->sin_family = AF_INET;
+		from->sin_addr.s_addr = ip.saddr;
+		to->sin_addr.s_addr = ip.daddr;
+		msg.plen = sizeof(*from);
+	} else if (proto == 0x86dd) {
+		ip6_hdr ip6;
+		if (len < sizeof(ip6))
+			return 0;
+		memcpy(&ip6, ptr, sizeof(ip6));
+
+		size_t plen = ntohs(ip6.ip6_plen);
+		if ((ip6.ip6_vfc>>4) != 6 || ip6.ip6_nxt != IPPROTO_UDP)
+			return 0;
+		if (plen > len - sizeof(ip6) || plen < sizeof(udphdr))
+			return 0;
+		ptr += sizeof(ip6);
+		len = plen;
+
+		sockaddr_in6 *from = reinterpret_cast<sockaddr_in6 *>(&msg.peer);
+		sockaddr_in6 *to = reinterpret_cast<sockaddr_in6 *>(&msg.local);
+		from->sin6_family = to->sin6_family = AF_INET6;
+		memcpy(&from->sin6_addr, &ip6.ip6_src, sizeof(from->sin6_addr));
+		memcpy(&to->sin6_addr, &ip6.ip6_dst, sizeof(to->sin6_addr));
+		msg.plen = sizeof(*from);
+	} else
+		return 0;
+
+	udphdr udp;
+	memcpy(&udp, ptr, sizeof(udp));
+	size_t ulen = ntohs(udp.len);
+	if (ulen < sizeof(udp) || ulen > len || ulen - sizeof(udp) > msg.query.size())
+		return 0;
+
+	// ports at the same place for both families
+	reinterpret_cast<sockaddr_in *>(&msg.peer)->sin_port = udp.source;
+	reinterpret_cast<sockaddr_in *>(&msg.local)->sin_port = udp.dest;
+
+	// the frame is only valid until the next pcap_next_ex()
+	msg.qlen = ulen - sizeof(udp);
+	memcpy(&msg.query[0], ptr + sizeof(udp), msg.qlen);
+	msg.qbuf = &msg.query[0];
+	msg.rlen = 0;
+	msg.action = QDNS_MSG_DROP;
+
+	return 1;
+}
+
+
+int pcap_file_provider::recv(vector<dns_msg> &msgs)
+{
+	if (!in)
+		return build_error("recv: pcap_file_provider not initialized");
+	if (eof)
+		return 0;
+
+	if (ts.size() < msgs.size()) {
+		try {
+			ts.resize(msgs.size());
+		} catch (...) {
+			return build_error("recv: OOM");
+		}
+	}
+
+	if (queries == 0 && start == 0)
+		start = now();
+
+	size_t n = 0;
+	pcap_pkthdr *h = nullptr;
+	const unsigned char *frame = nullptr;
+
+	while (n < msgs.size()) {
+		int r = pcap_next_ex(in, &h, &frame);
+		if (r == 0)
+			continue;
+		if (r == -2) {
+			eof = 1;
+			elapsed = now() - start;
+			break;
+		}
+		if (r < 0) {
+			if (n > 0)
+				break;
+			return build_error(string("recv: pcap_next_ex: ") + pcap_geterr(in));
+		}
+
+		if (parse(frame, h->caplen, msgs[n]))
+			ts[n++] = h->ts;
+	}
+
+	queries += n;
+	return n;
+}
+
+
+// one UDP datagram from -> to, with valid checksums
+int pcap_file_provider::write(const timeval &tv, const sockaddr_storage &from, const sockaddr_storage &to,
+                              const char *data, size_t len)
+{
+	char *ptr = &pkt[0];
+
+	udphdr udp;
+	udp.source = reinterpret_cast<const sockaddr_in *>(&from)->sin_port;
+	udp.dest = reinterpret_cast<const sockaddr_in *>(&to)->sin_port;
+	udp.len = htons(sizeof(udp) + len);
+	udp.check = 0;
+
+	uint32_t sum = 0;
+	if (from.ss_family == AF_INET) {
+		iphdr ip;
+		memset(&ip, 0, sizeof(ip));
+		ip.version = 4;
+		ip.ihl = sizeof(ip)/4;
+		ip.tot_len = htons(sizeof(ip) + sizeof(udp) + len);
+		ip.frag_off = htons(IP_DF);
+		ip.ttl = 64;
+		ip.protocol = IPPROTO_UDP;
+		ip.saddr = reinterpret_cast<const sockaddr_in *>(&from)->sin_addr.s_addr;
+		ip.daddr = reinterpret_cast<const sockaddr_in *>(&to)->sin_addr.s_addr;
+		ip.check = cksum_fold(cksum_add(0, &ip, sizeof(ip)));
+		memcpy(ptr, &ip, sizeof(ip));
+		sum = cksum_add(0, &ip.saddr, 2*sizeof(ip.saddr));
+		ptr += sizeof(ip);
+	} else {
+		ip6_hdr ip6;
+		memset(&ip6, 0, sizeof(ip6));
+		ip6.ip6_flow = htonl(6<<28);
+		ip6.ip6_plen = udp.len;
+		ip6.ip6_nxt = IPPROTO_UDP;
+		ip6.ip6_hlim = 64;
+		memcpy(&ip6.ip6_src, &reinterpret_cast<const sockaddr_in6 *>(&from)->sin6_addr, sizeof(ip6.ip6_src));
+		memcpy(&ip6.ip6_dst, &reinterpret_cast<const sockaddr_in6 *>(&to)->sin6_addr, sizeof(ip6.ip6_dst));
+		memcpy(ptr, &ip6, sizeof(ip6));
+		sum = cksum_add(0, &ip6.ip6_src, 2*sizeof(ip6.ip6_src));
+		ptr += sizeof(ip6);
+	}
+
+	// pseudo header, UDP header and payload
+	sum += htons(IPPROTO_UDP) + udp.len;
+	sum += udp.source + udp.dest + udp.len;
+	sum = cksum_add(sum, data, len);
+	if ((udp.check = cksum_fold(sum)) == 0)
+		udp.check = 0xffff;
+
+	memcpy(ptr, &udp, sizeof(udp));
+	ptr += sizeof(udp);
+	memcpy(ptr, data, len);
+	ptr += len;
+
+	pcap_pkthdr h;
+	h.ts = tv;
+	h.caplen = h.len = ptr - &pkt[0];
+	pcap_dump(reinterpret_cast<unsigned char *>(out), &h, reinterpret_cast<const unsigned char *>(&pkt[0]));
+
+	return 0;
+}
+
+
+int pcap_file_provider::reply(vector<dns_msg> &msgs, int n)
+{
+	for (int i = 0; i < n && i < (int)ts.size(); ++i) {
+		dns_msg &msg = msgs[i];
+		if (msg.action != QDNS_MSG_REPLY)
+			continue;
+		++replies;
+		if (out)
+			write(ts[i], msg.local, msg.peer, msg.flat_reply(), msg.rlen);
+	}
+
+	return 0;
+}
+
+
+// the query itself, on to where it was going
+int pcap_file_provider::resend(vector<dns_msg> &msgs, int n)
+{
+	for (int i = 0; i < n && i < (int)ts.size(); ++i) {
+		const dns_msg &msg = msgs[i];
+		if (msg.action != QDNS_MSG_RESEND)
+			continue;
+		if (out)
+			write(ts[i], msg.peer, msg.local, msg.qbuf, msg.qlen);
+	}
+
+	return 0;
+}
+
+
+int pcap_file_provider::build_error(const string &s)
+{
+	err = "pcap_file_provider::";
+	err += s;
+	if (errno) {
+		err += ": ";
+		err += strerror(errno);
+	}
+	return -1;
+}
+
+
+} // namespace
+
@@ -19,6 +19,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <cstring>
 #include <cstdlib>
 #include <cerrno>
@@ -48,6 +49,11 @@ int socket_provider::init(const map<string, string> &args)
 	if ((it = args.find("lport")) != args.end())
 		lport = it->second;
 
+	if ((it = args.find("batch")) != args.end())
+		batch = strtoul(it->second.c_str(), NULL, 10);
+	if (batch == 0)
+		batch = 1;
+
 	addrinfo *ai = NULL;
 	if (getaddrinfo(laddr.c_str(), lport.c_str(), NULL, &ai) != 0)
 		return build_error("init: failed to resolve 'laddr'");
@@ -55,56 +61,152 @@ int socket_provider::init(const map<string, string> &args)
 	if ((sock = socket(ai->ai_family, SOCK_DGRAM, 0)) < 0)
 		return build_error("init: socket");
 
+	// several workers listening on the same laddr/lport
+	if (args.count("reuseport") > 0) {
+		int one = 1;
+#ifdef SO_REUSEPORT_LB
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT_LB, &one, sizeof(one)) < 0)
+#else
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+#endif
+			return build_error("init: setsockopt(SO_REUSEPORT)");
+	}
+
 	if (::bind(sock, ai->ai_addr, ai->ai_addrlen) < 0)
 		return build_error("init: bind");
 
 	family = ai->ai_family;
 
+#ifdef QDNS_HAVE_MMSG
+	try {
+		rxhdr.resize(batch);
+		txhdr.resize(batch);
+		rxiov.resize(batch);
+		txiov.resize(batch*dns_msg::reply_iovs);
+	} catch (...) {
+		return build_error("init: OOM");
+	}
+#endif
+
 	return 0;
 }
 
 
-int socket_provider::recv(string &pkt)
+#ifdef QDNS_HAVE_MMSG
+
+int socket_provider::recv(vector<dns_msg> &msgs)
 {
-	pkt = "";
+	size_t n = msgs.size() < batch ? msgs.size() : batch;
+
+	for (size_t i = 0; i < n; ++i) {
+		rxiov[i].iov_base = &msgs[i].query[0];
+		rxiov[i].iov_len = msgs[i].query.size();
+		memset(&rxhdr[i], 0, sizeof(rxhdr[i]));
+		rxhdr[i].msg_hdr.msg_iov = &rxiov[i];
+		rxhdr[i].msg_hdr.msg_iovlen = 1;
+		rxhdr[i].msg_hdr.msg_name = &msgs[i].peer;
+		rxhdr[i].msg_hdr.msg_namelen = sizeof(msgs[i].peer);
+	}
 
-	char buf[1024];
-	sockaddr *from = (sockaddr *)&from4;
-	socklen_t flen = sizeof(from4);
+	// block for the first one, then take whatever else is already queued
+	int r = 0;
+	if ((r = recvmmsg(sock, &rxhdr[0], n, MSG_WAITFORONE, NULL)) < 0)
+		return build_error("recv: recvmmsg");
+
+	for (int i = 0; i < r; ++i) {
+		msgs[i].qbuf = &msgs[i].query[0];
+		msgs[i].qlen = rxhdr[i].msg_len;
+		msgs[i].rlen = 0;
+		msgs[i].plen = rxhdr[i].msg_hdr.msg_namelen;
+		msgs[i].action = QDNS_MSG_DROP;
+	}
 
-	if (family == AF_INET6) {
-		from = (sockaddr *)&from6;
-		flen = sizeof(from6);
+	return r;
+}
+
+
+int socket_provider::reply(vector<dns_msg> &msgs, int n)
+{
+	int ntx = 0, r = 0, failed = 0;
+
+	for (int i = 0; i < n && ntx < (int)txhdr.size(); ++i) {
+		if (msgs[i].action != QDNS_MSG_REPLY)
+			continue;
+		iovec *iov = &txiov[ntx*dns_msg::reply_iovs];
+		msgs[i].reply_iov(iov);
+		memset(&txhdr[ntx], 0, sizeof(txhdr[ntx]));
+		txhdr[ntx].msg_hdr.msg_iov = iov;
+		txhdr[ntx].msg_hdr.msg_iovlen = dns_msg::reply_iovs;
+		txhdr[ntx].msg_hdr.msg_name = &msgs[i].peer;
+		txhdr[ntx].msg_hdr.msg_namelen = msgs[i].plen;
+		++ntx;
 	}
 
-	memset(buf, 0, sizeof(buf));
+	// sendmmsg() stops at the first failing datagram, so skip it
+	// and go on with the rest of the batch
+	for (int i = 0; i < ntx;) {
+		if ((r = sendmmsg(sock, &txhdr[i], ntx - i, 0)) < 0) {
+			build_error("reply: sendmmsg");
+			++failed;
+			++i;
+			continue;
+		}
+		i += r;
+	}
+
+	return failed ? -1 : 0;
+}
+
+#else
+
+int socket_provider::recv(vector<dns_msg> &msgs)
+{
+	if (msgs.size() == 0)
+		return 0;
+
+	dns_msg &msg = msgs[0];
+	socklen_t flen = sizeof(msg.peer);
 
 	ssize_t r = 0;
-	if ((r = recvfrom(sock, buf, sizeof(buf), 0, from, &flen)) < 0)
+	if ((r = recvfrom(sock, &msg.query[0], msg.query.size(), 0, (sockaddr *)&msg.peer, &flen)) < 0)
 		return build_error("recv: recvfrom");
 
-	pkt = string(buf, r);
+	msg.qbuf = &msg.query[0];
+	msg.qlen = r;
+	msg.rlen = 0;
+	msg.plen = flen;
+	msg.action = QDNS_MSG_DROP;
 
-	return 0;
+	return 1;
 }
 
 
-int socket_provider::reply(const string &pkt)
+int socket_provider::reply(vector<dns_msg> &msgs, int n)
 {
-	sockaddr *from = (sockaddr *)&from4;
-	socklen_t flen = sizeof(from4);
-
-	if (family == AF_INET6) {
-		from = (sockaddr *)&from6;
-		flen = sizeof(from6);
+	int failed = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (msgs[i].action != QDNS_MSG_REPLY)
+			continue;
+		iovec iov[dns_msg::reply_iovs];
+		msgs[i].reply_iov(iov);
+		msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = &msgs[i].peer;
+		mh.msg_namelen = msgs[i].plen;
+		mh.msg_iov = iov;
+		mh.msg_iovlen = dns_msg::reply_iovs;
+		if (sendmsg(sock, &mh, 0) < 0) {
+			build_error("reply: sendmsg");
+			++failed;
+		}
 	}
 
-	if (sendto(sock, pkt.c_str(), pkt.size(), 0, from, flen) < 0)
-		return build_error("send: sendto");
-
-	return 0;
+	return failed ? -1 : 0;
 }
 
+#endif
+
 
 int socket_provider::build_error(const string &s)
 {
@@ -118,27 +220,39 @@ int socket_provider::build_error(const string &s)
 }
 
 
-string socket_provider::sender()
+size_t dns_provider::sender(const sockaddr *peer, char *buf, size_t len) const
 {
-	char buf[256];
-	string s = "<err>";
+	size_t n = 0;
+
+	if (peer->sa_family == AF_INET) {
+		const sockaddr_in *from4 = reinterpret_cast<const sockaddr_in *>(peer);
+		if (!inet_ntop(AF_INET, &from4->sin_addr, buf, len))
+			return snprintf(buf, len, "<err>");
+		n = strlen(buf);
+		n += snprintf(buf + n, len - n, ":%d", ntohs(from4->sin_port));
+	} else if (peer->sa_family == AF_INET6) {
+		const sockaddr_in6 *from6 = reinterpret_cast<const sockaddr_in6 *>(peer);
+		if (!inet_ntop(AF_INET6, &from6->sin6_addr, buf, len))
+			return snprintf(buf, len, "<err>");
+		n = strlen(buf);
+		n += snprintf(buf + n, len - n, "#%d", ntohs(from6->sin6_port));
+	} else
+		return snprintf(buf, len, "<err>");
+
+	return n < len ? n : len - 1;
+}
 
-	memset(buf, 0, sizeof(buf));
 
-	if (family == AF_INET) {
-		if (!inet_ntop(AF_INET, &from4.sin_addr, buf, sizeof(buf)))
-			return s;
-		s = buf;
-		snprintf(buf, sizeof(buf), ":%d", ntohs(from4.sin_port));
-		s += buf;
-	} else {
-		if (!inet_ntop(AF_INET6, &from6.sin6_addr, buf, sizeof(buf)))
-			return s;
-		s = buf;
-		snprintf(buf, sizeof(buf), "#%d", ntohs(from6.sin6_port));
-		s += buf;
+size_t dns_provider::host(const sockaddr *peer, char *buf, size_t len)
+{
+	if (peer->sa_family == AF_INET) {
+		if (inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in *>(peer)->sin_addr, buf, len))
+			return strlen(buf);
+	} else if (peer->sa_family == AF_INET6) {
+		if (inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6 *>(peer)->sin6_addr, buf, len))
+			return strlen(buf);
 	}
-	return s;
+	return snprintf(buf, len, "<err>");
 }
 
 
@@ -193,99 +307,155 @@ int usipp_provider::init(const map<string, string> &args)
 }
 
 
-int usipp_provider::recv(string &pkt)
+// libpcap hands us one frame per call, so usipp batches are always
+// of size 1. The addresses are kept per message though, so reply()
+// does not depend on whatever mon4/mon6 sniffed last.
+int usipp_provider::recv(vector<dns_msg> &msgs)
 {
-	pkt = "";
-
 	if (!mon4 && !mon6)
 		return build_error("usipp_provider not initialized");
 
+	if (msgs.size() == 0)
+		return 0;
+
+	dns_msg &msg = msgs[0];
+	msg.qlen = 0;
+	msg.rlen = 0;
+	msg.action = QDNS_MSG_DROP;
+
 	if (mon4) {
-		mon4->sniffpack(pkt);
-		if (!pkt.size())
+		mon4->sniffpack(rxpkt);
+		if (!rxpkt.size())
 			return build_error("recv: " + string(mon4->why()));
-		mon4->get_src(src4);
+
+		sockaddr_in *from = reinterpret_cast<sockaddr_in *>(&msg.peer);
+		sockaddr_in *to = reinterpret_cast<sockaddr_in *>(&msg.local);
+		from->sin_family = to->sin_family = AF_INET;
+		from->sin_addr.s_addr = mon4->get_src();
+		from->sin_port = htons(mon4->get_srcport());
+		to->sin_addr.s_addr = mon4->get_dst();
+		to->sin_port = htons(mon4->get_dstport());
+		msg.plen = sizeof(*from);
 	} else if (mon6) {
-		mon6->sniffpack(pkt);
-		if (!pkt.size())
+		mon6->sniffpack(rxpkt);
+		if (!rxpkt.size())
 			return build_error("recv: " + string(mon6->why()));
-		mon6->get_src(src6);
+
+		sockaddr_in6 *from = reinterpret_cast<sockaddr_in6 *>(&msg.peer);
+		sockaddr_in6 *to = reinterpret_cast<sockaddr_in6 *>(&msg.local);
+		from->sin6_family = to->sin6_family = AF_INET6;
+		usipp::in6_addr s = mon6->get_src(), d = mon6->get_dst();
+		memcpy(&from->sin6_addr, &s, sizeof(from->sin6_addr));
+		from->sin6_port = htons(mon6->get_srcport());
+		memcpy(&to->sin6_addr, &d, sizeof(to->sin6_addr));
+		to->sin6_port = htons(mon6->get_dstport());
+		msg.plen = sizeof(*from);
 	}
 
-	return 0;
+	msg.qlen = rxpkt.size() < msg.query.size() ? rxpkt.size() : msg.query.size();
+	memcpy(&msg.query[0], rxpkt.c_str(), msg.qlen);
+	msg.qbuf = &msg.query[0];
+
+	return 1;
 }
 
 
-int usipp_provider::reply(const string &pkt)
+int usipp_provider::reply(vector<dns_msg> &msgs, int n)
 {
 	if (!mon4 && !mon6)
 		return build_error("usipp_provider not initialized");
-	if (mon4) {
-		uint32_t s = mon4->get_src();
-		uint32_t d = mon4->get_dst();
-		uint16_t dport = mon4->get_dstport();
-
-		mon4->set_src(d);
-		mon4->set_dst(s);
-		mon4->set_dstport(mon4->get_srcport());
-		mon4->set_srcport(dport);
-		mon4->set_options("");
-		mon4->set_totlen(0);	// IPv4 len
-		mon4->set_len(0);	// UDP len
-		mon4->set_ttl(64);
-		if (mon4->sendpack(pkt) < 0)
-			return build_error("reply: " + string(mon4->why()));
-	} else if (mon6) {
-		usipp::in6_addr s = mon6->get_src();
-		usipp::in6_addr d = mon6->get_dst();
-		uint16_t dport = mon6->get_dstport();
 
-		mon6->set_src(d);
-		mon6->set_dst(s);
-		mon6->set_dstport(mon6->get_srcport());
-		mon6->set_srcport(dport);
+	int failed = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (msgs[i].action != QDNS_MSG_REPLY)
+			continue;
+
+		if (mon4) {
+			const sockaddr_in *from = reinterpret_cast<const sockaddr_in *>(&msgs[i].peer);
+			const sockaddr_in *to = reinterpret_cast<const sockaddr_in *>(&msgs[i].local);
+
+			mon4->set_src(to->sin_addr.s_addr);
+			mon4->set_dst(from->sin_addr.s_addr);
+			mon4->set_dstport(ntohs(from->sin_port));
+			mon4->set_srcport(ntohs(to->sin_port));
+			mon4->set_options("");
+			mon4->set_totlen(0);	// IPv4 len
+			mon4->set_len(0);	// UDP len
+			mon4->set_ttl(64);
+			txpkt.assign(msgs[i].flat_reply(), msgs[i].rlen);
+			if (mon4->sendpack(txpkt) < 0) {
+				build_error("reply: " + string(mon4->why()));
+				++failed;
+			}
+		} else if (mon6) {
+			const sockaddr_in6 *from = reinterpret_cast<const sockaddr_in6 *>(&msgs[i].peer);
+			const sockaddr_in6 *to = reinterpret_cast<const sockaddr_in6 *>(&msgs[i].local);
+			usipp::in6_addr s, d;
+			memcpy(&s, &from->sin6_addr, sizeof(s));
+			memcpy(&d, &to->sin6_addr, sizeof(d));
+
+			mon6->set_src(d);
+			mon6->set_dst(s);
+			mon6->set_dstport(ntohs(from->sin6_port));
+			mon6->set_srcport(ntohs(to->sin6_port));
 
 #if !defined __linux__ || USE_L2TX
-		// since we use L2 TX, also swap layer2 addresses
-		string l2src = "", l2dst = "";
-		mon6->raw_rx()->get_l2src(l2src);
-		mon6->raw_rx()->get_l2dst(l2dst);
-		mon6->raw_tx()->set_l2src(l2dst);
-		mon6->raw_tx()->set_l2dst(l2src);
+			// since we use L2 TX, also swap layer2 addresses
+			string l2src = "", l2dst = "";
+			mon6->raw_rx()->get_l2src(l2src);
+			mon6->raw_rx()->get_l2dst(l2dst);
+			mon6->raw_tx()->set_l2src(l2dst);
+			mon6->raw_tx()->set_l2dst(l2src);
 #endif
-		mon6->clear_headers();
-		mon6->set_payloadlen(0);
-		mon6->set_len(0);
-		mon6->set_hoplimit(64);
-		if (mon6->sendpack(pkt) < 0)
-			return build_error("reply: " + string(mon6->why()));
+			mon6->clear_headers();
+			mon6->set_payloadlen(0);
+			mon6->set_len(0);
+			mon6->set_hoplimit(64);
+			txpkt.assign(msgs[i].flat_reply(), msgs[i].rlen);
+			if (mon6->sendpack(txpkt) < 0) {
+				build_error("reply: " + string(mon6->why()));
+				++failed;
+			}
+		}
 	}
-	return 0;
+	return failed ? -1 : 0;
 }
 
 
-int usipp_provider::resend(const string &pkt)
+// batches are of size 1 (see recv()), so the headers of the
+// sniffed query are still in place and can be sent out as they are
+int usipp_provider::resend(vector<dns_msg> &msgs, int n)
 {
 	if (!mon4 && !mon6)
 		return build_error("usipp_provider not initialized");
-	if (mon4) {
-		if (mon4->sendpack(pkt) < 0)
-			return build_error("reply: " + string(mon4->why()));
-	} else if (mon6) {
-		if (mon6->sendpack(pkt) < 0)
-			return build_error("reply: " + string(mon6->why()));
+
+	int failed = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (msgs[i].action != QDNS_MSG_RESEND)
+			continue;
+		txpkt.assign(&msgs[i].query[0], msgs[i].qlen);
+		if (mon4) {
+			if (mon4->sendpack(txpkt) < 0) {
+				build_error("reply: " + string(mon4->why()));
+				++failed;
+			}
+		} else if (mon6) {
+			if (mon6->sendpack(txpkt) < 0) {
+				build_error("reply: " + string(mon6->why()));
+				++failed;
+			}
+		}
 	}
-	return 0;
+	return failed ? -1 : 0;
 }
 
 
-string usipp_provider::sender()
+// only the address: the peer in monitor mode is some host on the wire
+size_t usipp_provider::sender(const sockaddr *peer, char *buf, size_t len) const
 {
-	if (mon4)
-		return src4;
-	else if (mon6)
-		return src6;
-	return "<err>";
+	return host(peer, buf, len);
 }
 
 
@@ -22,12 +22,136 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <cstdint>
+#include <cstring>
 #include <usi++/usi++.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
+// recvmmsg()/sendmmsg() batching; elsewhere we fall back to
+// one recvfrom()/sendto() per packet
+#if defined __linux__ || defined __FreeBSD__ || defined __NetBSD__ || defined __OpenBSD__
+#define QDNS_HAVE_MMSG
+#endif
+
+// AF_PACKET capture rings for monitor mode, io_uring sockets, epoll
+// for the TCP listener
+#ifdef __linux__
+#define QDNS_HAVE_TPACKET
+#define QDNS_HAVE_URING
+#define QDNS_HAVE_EPOLL
+#endif
+
+#ifdef QDNS_HAVE_TPACKET
+struct tpacket_block_desc;
+struct tpacket3_hdr;
+#endif
+
+#ifdef QDNS_HAVE_EPOLL
+struct epoll_event;
+#endif
+
+// libpcap's pcap_t and pcap_dumper_t
+struct pcap;
+struct pcap_dumper;
+
 namespace qdns {
 
+
+typedef enum {
+	QDNS_MSG_DROP	= 0,
+	QDNS_MSG_REPLY,
+	QDNS_MSG_RESEND
+} msg_action;
+
+
+// the UDP payload size we advertise in EDNS0 replies (RFC 6891), which
+// is also the largest query we take
+const uint16_t dns_edns_size = 1232;
+
+// receive and reply buffer sizes of a dns_msg
+const size_t dns_max_query = dns_edns_size;
+const size_t dns_max_reply = 65535;
+
+
+// One slot of a batch: a received query, the peer it came from
+// and what the engine decided to send back. The buffers are allocated
+// once, so the providers receive into and send from them directly.
+struct dns_msg {
+	std::vector<char> query, reply;
+	size_t qlen, rlen;
+
+	// The rlen bytes of the reply are not copied together: they are
+	// the header in rhdr, the question right out of qbuf, the answer
+	// RRs right out of the zone and the OPT RR if the query had one,
+	// so they are valid as long as qbuf is. Providers with
+	// scatter/gather I/O send the pieces as they are, the others
+	// gather() them into reply.
+	char rhdr[12];
+	const char *rq, *rrs, *ropt;
+	size_t rq_len, rrs_len, ropt_len;
+
+	// The qlen bytes of the query, set by recv(): either &query[0] or,
+	// for providers that capture into shared memory, right inside the
+	// captured frame. Valid until the next recv() of the same provider.
+	const char *qbuf;
+
+	// peer is where the query came from; local is where it was sent to,
+	// which only matters in monitor mode where we answer for others
+	sockaddr_storage peer, local;
+	socklen_t plen;
+
+	msg_action action;
+
+	dns_msg() : query(dns_max_query), reply(dns_max_reply), qlen(0), rlen(0),
+	            rq(nullptr), rrs(nullptr), ropt(nullptr), rq_len(0), rrs_len(0), ropt_len(0),
+	            qbuf(nullptr), plen(0), action(QDNS_MSG_DROP)
+	{
+		memset(rhdr, 0, sizeof(rhdr));
+		memset(&peer, 0, sizeof(peer));
+		memset(&local, 0, sizeof(local));
+	}
+
+	enum {
+		reply_iovs = 4
+	};
+
+	// point reply_iovs iovecs at the pieces of the reply
+	void reply_iov(iovec *iov) const
+	{
+		iov[0].iov_base = const_cast<char *>(rhdr);
+		iov[0].iov_len = sizeof(rhdr);
+		iov[1].iov_base = const_cast<char *>(rq);
+		iov[1].iov_len = rq_len;
+		iov[2].iov_base = const_cast<char *>(rrs);
+		iov[2].iov_len = rrs_len;
+		iov[3].iov_base = const_cast<char *>(ropt);
+		iov[3].iov_len = ropt_len;
+	}
+
+	// copy the reply into buf, which must have room for rlen bytes
+	void gather(char *buf) const
+	{
+		memcpy(buf, rhdr, sizeof(rhdr));
+		memcpy(buf + sizeof(rhdr), rq, rq_len);
+		memcpy(buf + sizeof(rhdr) + rq_len, rrs, rrs_len);
+		if (ropt_len)
+			memcpy(buf + sizeof(rhdr) + rq_len + rrs_len, ropt, ropt_len);
+	}
+
+	// the reply in one piece, inside reply
+	const char *flat_reply()
+	{
+		gather(&reply[0]);
+		return &reply[0];
+	}
+};
+
+
 class dns_provider {
 
 protected:
@@ -36,6 +160,9 @@ protected:
 
 	virtual int build_error(const std::string &) = 0;
 
+	// peer address without the port
+	static size_t host(const sockaddr *, char *buf, size_t len);
+
 
 public:
 	dns_provider() = default;
@@ -46,13 +173,48 @@ public:
 
 	virtual int init(const std::map<std::string, std::string> &) = 0;
 
-	virtual int recv(std::string &pkt) = 0;
+	// fills up to msgs.size() slots and returns how many were filled
+	virtual int recv(std::vector<dns_msg> &msgs) = 0;
+
+	// send all replies of the first n slots that are marked QDNS_MSG_REPLY
+	virtual int reply(std::vector<dns_msg> &msgs, int n) = 0;
 
-	virtual int reply(const std::string &pkt) = 0;
+	// human readable peer into buf, returns its length
+	virtual size_t sender(const sockaddr *, char *buf, size_t len) const;
+
+	size_t sender(const dns_msg &msg, char *buf, size_t len) const
+	{
+		return sender(reinterpret_cast<const sockaddr *>(&msg.peer), buf, len);
+	}
+
+	std::string sender(const dns_msg &msg) const
+	{
+		char buf[128];
+		return std::string(buf, sender(msg, buf, sizeof(buf)));
+	}
+
+	// same for QDNS_MSG_RESEND, which sends the query itself
+	virtual int resend(std::vector<dns_msg> &msgs, int n)
+	{
+		return 0;
+	}
+
+	// no queries will come anymore, e.g. at the end of a replayed capture
+	virtual bool done() const
+	{
+		return 0;
+	}
 
-	virtual std::string sender() = 0;
+	// whether TTL=1 "once" RRs are answered once per peer address and
+	// port, or once per address
+	virtual bool once_port() const
+	{
+		return 1;
+	}
 
-	virtual int resend(const std::string &pkt)
+	// whether replies go over a stream, so their size is not limited
+	// by what the peer takes in one datagram
+	virtual bool stream() const
 	{
 		return 0;
 	}
@@ -68,20 +230,26 @@ public:
 
 class socket_provider : public dns_provider {
 
+protected:
+
 	int sock, family;
 	std::string laddr, lport;
 
-	sockaddr_in from4;
-	sockaddr_in6 from6;
+	// recvmmsg()/sendmmsg() scratch, sized once by init()
+	size_t batch;
+#ifdef QDNS_HAVE_MMSG
+	std::vector<mmsghdr> rxhdr, txhdr;
+	std::vector<iovec> rxiov, txiov;
+#endif
 
-protected:
 
 	int build_error(const std::string &);
 
 
 public:
 
-	socket_provider() : sock(-1), family(AF_INET), laddr("0.0.0.0"), lport("53")
+	socket_provider() : sock(-1), family(AF_INET), laddr("0.0.0.0"), lport("53"),
+	                    batch(1)
 	{
 	}
 
@@ -91,11 +259,9 @@ public:
 
 	virtual int init(const std::map<std::string, std::string> &);
 
-	virtual int recv(std::string &pkt);
-
-	virtual int reply(const std::string &pkt);
+	virtual int recv(std::vector<dns_msg> &);
 
-	virtual std::string sender();
+	virtual int reply(std::vector<dns_msg> &, int);
 };
 
 
@@ -104,8 +270,8 @@ class usipp_provider : public dns_provider {
 	usipp::UDP4 *mon4;
 	usipp::UDP6 *mon6;
 
-	std::string src4;
-	std::string src6;
+	// libusi++ sniffs into and sends from strings
+	std::string rxpkt, txpkt;
 
 	int family;
 
@@ -115,22 +281,367 @@ protected:
 
 
 public:
-	usipp_provider() : mon4(NULL), mon6(NULL),
-	           src4(""), src6(""), family(AF_UNSPEC)
+	usipp_provider() : mon4(NULL), mon6(NULL), rxpkt(""), txpkt(""), family(AF_UNSPEC)
 	{}
 
 	virtual int init(const std::map<std::string, std::string> &);
 
-	virtual int recv(std::string &pkt);
+	virtual int recv(std::vector<dns_msg> &);
+
+	virtual int reply(std::vector<dns_msg> &, int);
 
-	virtual int reply(const std::string &pkt);
+	virtual int resend(std::vector<dns_msg> &, int);
 
-	virtual int resend(const std::string &pkt);
+	using dns_provider::sender;
 
-	virtual std::string sender();
+	virtual size_t sender(const sockaddr *, char *, size_t) const;
+
+	virtual bool once_port() const
+	{
+		return 0;
+	}
 };
 
 
+// Replays a capture file rather than talking to the network: recv()
+// reads the queries from it as fast as the engine takes them, and the
+// replies go into another capture file as raw IP packets, stamped with
+// the time of their query. No sockets and no privileges are needed, so
+// the engine's throughput can be measured apart from the kernel, and the
+// replies of two versions can be diffed.
+class pcap_file_provider : public dns_provider {
+
+	pcap *in, *dead;
+	pcap_dumper *out;
+	int linktype;
+
+	// capture time of each msg of the current batch
+	std::vector<timeval> ts;
+
+	// where a reply is put together
+	std::vector<char> pkt;
+
+	bool eof;
+	uint64_t queries, replies;
+	double start, elapsed;
+
+	bool parse(const unsigned char *, size_t, dns_msg &);
+
+	int write(const timeval &, const sockaddr_storage &, const sockaddr_storage &, const char *, size_t);
+
+protected:
+
+	int build_error(const std::string &);
+
+
+public:
+	pcap_file_provider() : in(nullptr), dead(nullptr), out(nullptr), linktype(0),
+	                       eof(0), queries(0), replies(0), start(0), elapsed(0)
+	{
+	}
+
+	virtual ~pcap_file_provider();
+
+	virtual int init(const std::map<std::string, std::string> &);
+
+	virtual int recv(std::vector<dns_msg> &);
+
+	virtual int reply(std::vector<dns_msg> &, int);
+
+	virtual int resend(std::vector<dns_msg> &, int);
+
+	virtual bool done() const
+	{
+		return eof;
+	}
+};
+
+
+#ifdef QDNS_HAVE_TPACKET
+
+// Monitor mode straight off an AF_PACKET TPACKET_V3 RX ring. The kernel
+// fills whole blocks of frames into memory that is shared with us, and
+// recv() parses IP/UDP right there, leaving qbuf pointing into the ring.
+// Blocks are handed back to the kernel by the next recv(), once nothing
+// refers to them anymore. Replies are written into a PACKET_TX_RING on
+// the same device, with the L2 addresses of the captured frame swapped,
+// and the whole batch is sent by a single sendto(). Resends (-R) must be
+// routed to where the query was headed rather than back out the capture
+// device, so they go through a raw IP socket instead. With several
+// workers, each has its own rings, and the RX rings form one fanout group.
+class tpacket_provider : public dns_provider {
+
+	int sock, txsock, family;
+
+	char *ring;
+	size_t ring_len, block_size, nblocks;
+
+	// blocks head ... head + nheld - 1 are ours; the last one of
+	// them still has left frames, starting at frame
+	size_t head, nheld;
+	const char *frame;
+	uint32_t left;
+
+	// the frame each msg of the current batch was parsed from
+	std::vector<const tpacket3_hdr *> frames;
+
+	char *txring;
+	size_t txring_len, tx_frame_size, tx_nframes, tx_next, tx_pending, mtu;
+	sockaddr_storage txaddr;
+
+	// IP + UDP header of a reply with everything set that is the same for
+	// all flows, and the sum of its IPv4 header words, so that only the
+	// words of the flow are added per packet
+	char tmpl[40 + 8];
+	size_t tmpl_len;
+	uint32_t tmpl_sum;
+
+	// sendmmsg() scratch of resends; each message gets its own IP/UDP
+	// header and a destination with the port cleared, as raw sockets want it
+	int rawsock;
+	size_t batch;
+	std::vector<mmsghdr> rawhdr;
+	std::vector<iovec> rawiov;
+	std::vector<sockaddr_storage> rawdst;
+	std::vector<char> rawhdrs;
+
+	tpacket_block_desc *block(size_t idx)
+	{
+		return reinterpret_cast<tpacket_block_desc *>(ring + idx * block_size);
+	}
+
+	void release();
+
+	bool parse(const tpacket3_hdr *, dns_msg &);
+
+	char *tx_frame();
+
+	int flush();
+
+	size_t build(char *, const tpacket3_hdr *, const dns_msg &);
+
+	size_t build_resend(char *, const dns_msg &);
+
+protected:
+
+	int build_error(const std::string &);
+
+
+public:
+	tpacket_provider() : sock(-1), txsock(-1), family(AF_INET), ring(nullptr), ring_len(0),
+	                     block_size(1<<20), nblocks(64), head(0), nheld(0), frame(nullptr),
+	                     left(0), txring(nullptr), txring_len(0), tx_frame_size(2048),
+	                     tx_nframes(512), tx_next(0), tx_pending(0), mtu(1500), tmpl_len(0),
+	                     tmpl_sum(0), rawsock(-1), batch(1)
+	{
+		memset(&txaddr, 0, sizeof(txaddr));
+	}
+
+	virtual ~tpacket_provider();
+
+	virtual int init(const std::map<std::string, std::string> &);
+
+	virtual int recv(std::vector<dns_msg> &);
+
+	virtual int reply(std::vector<dns_msg> &, int);
+
+	virtual int resend(std::vector<dns_msg> &, int);
+
+	using dns_provider::sender;
+
+	virtual size_t sender(const sockaddr *, char *, size_t) const;
+
+	virtual bool once_port() const
+	{
+		return 0;
+	}
+};
+
+#endif
+
+
+#ifdef QDNS_HAVE_URING
+
+// The same socket, driven through an io_uring. One multishot recvmsg
+// stays posted and the kernel picks a buffer for each datagram out of a
+// registered buffer ring, so receiving a batch is just reading the
+// completion queue; qbuf points into those buffers until the next
+// recv(). Replies are queued as one SENDMSG per message and submitted
+// together. If the kernel can't do any of this, the plain socket_provider
+// calls are used instead.
+class uring_provider : public socket_provider {
+
+	int ring_fd;
+
+	// the mmap()ed SQ/CQ rings and the indices into them
+	void *rings, *sqes;
+	size_t rings_len, sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	char *cqes;
+	unsigned sq_entries, to_submit;
+
+	// provided buffers: nbufs of buf_size each, handed to the kernel
+	// through br, which is ours to fill up to br_tail
+	void *br;
+	char *bufs;
+	size_t br_len, bufs_len, nbufs, buf_size;
+	uint16_t br_tail;
+
+	// buffer ids of the current batch
+	std::vector<uint16_t> held;
+
+	// completions reply() had to take off the CQ while waiting for its sends
+	struct cqe {
+		uint64_t data;
+		int32_t res;
+		uint32_t flags;
+	};
+	std::vector<cqe> stash;
+	size_t stash_pos;
+
+	msghdr rxmsg;
+	bool armed;
+	size_t inflight;
+
+	std::vector<msghdr> txmsg;
+
+	int setup();
+
+	void teardown();
+
+	void *get_sqe();
+
+	int enter(unsigned, unsigned);
+
+	bool next_cqe(cqe &);
+
+	void give_back(uint16_t);
+
+	bool parse(const cqe &, dns_msg &);
+
+	int reap_sends();
+
+protected:
+
+	int build_error(const std::string &);
+
+
+public:
+	uring_provider() : ring_fd(-1), rings(nullptr), sqes(nullptr), rings_len(0), sqes_len(0),
+	                   sq_head(nullptr), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr),
+	                   cq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr), cqes(nullptr),
+	                   sq_entries(0), to_submit(0), br(nullptr), bufs(nullptr), br_len(0),
+	                   bufs_len(0), nbufs(4096), buf_size(2048), br_tail(0), stash_pos(0),
+	                   armed(0), inflight(0)
+	{
+		memset(&rxmsg, 0, sizeof(rxmsg));
+	}
+
+	virtual ~uring_provider()
+	{
+		teardown();
+	}
+
+	virtual int init(const std::map<std::string, std::string> &);
+
+	virtual int recv(std::vector<dns_msg> &);
+
+	virtual int reply(std::vector<dns_msg> &, int);
+};
+
+#endif
+
+
+#ifdef QDNS_HAVE_EPOLL
+
+// DNS over TCP (RFC 7766) on laddr/lport, next to the UDP sockets. One
+// epoll set holds the listening socket and all connections. recv()
+// hands out every complete length-prefixed query that has arrived, so
+// queries pipelined on one connection go into the same batch, and qbuf
+// points right into the connection's input until the next recv().
+// Replies that can't be written at once are kept until the socket is
+// writable again. At most max_conns connections are served, and those
+// that sent nothing for idle seconds are closed.
+class tcp_provider : public dns_provider {
+
+	struct conn {
+		int fd;
+		uint32_t events;	// what epoll watches for
+		sockaddr_storage peer;
+		socklen_t plen;
+		std::vector<char> in;
+		size_t in_len, in_off;	// bytes read, bytes handed out as queries
+		std::string out;	// replies not written yet
+		uint32_t last;		// when the peer last sent something
+		bool eof, ready;	// ready: is in the ready list
+
+		conn() : fd(-1), events(0), plen(0), in_len(0), in_off(0), out(""), last(0),
+		         eof(0), ready(0)
+		{
+			memset(&peer, 0, sizeof(peer));
+		}
+	};
+
+	int lsock, ep;
+	std::string laddr, lport;
+
+	std::vector<conn> conns;
+	std::vector<size_t> free_slots;
+
+	// connections with a complete query not handed out yet
+	std::vector<size_t> ready;
+
+	// the connection of each message of the batch
+	std::vector<size_t> of;
+	size_t nof;
+
+	epoll_event *events;
+	size_t nevents;
+
+	size_t max_conns;
+	uint32_t idle, now, last_sweep;
+
+	void accept_all();
+
+	void read_some(size_t);
+
+	bool has_query(const conn &) const;
+
+	int flush(conn &);
+
+	void watch(size_t);
+
+	void close_conn(size_t);
+
+protected:
+
+	int build_error(const std::string &);
+
+
+public:
+	tcp_provider() : lsock(-1), ep(-1), laddr("0.0.0.0"), lport("53"), nof(0), events(nullptr),
+	                 nevents(0), max_conns(256), idle(10), now(0), last_sweep(0)
+	{
+	}
+
+	virtual ~tcp_provider();
+
+	virtual int init(const std::map<std::string, std::string> &);
+
+	virtual int recv(std::vector<dns_msg> &);
+
+	virtual int reply(std::vector<dns_msg> &, int);
+
+	virtual bool stream() const
+	{
+		return 1;
+	}
+};
+
+#endif
+
+
 }  // namespace
 
 #endif
@@ -18,12 +18,21 @@
  */
 
 #include <map>
-#include <list>
 #include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include "qdns.h"
 #include "misc.h"
@@ -50,22 +59,151 @@ int qdns::build_error(const string &s)
 
 int qdns::init(const map<string, string> &args)
 {
-	if (args.count("laddr"))
-		io = new (nothrow) socket_provider();
-	else if (args.count("mon") > 0)
-		io = new (nothrow) usipp_provider();
+	size_t threads = 1;
 
-	if (!io)
-		return build_error("init: OOM");
+	auto it = args.find("threads");
+	if (it != args.end())
+		threads = strtoul(it->second.c_str(), NULL, 10);
+	if (threads == 0)
+		threads = 1;
+
+	// each capture would see (and answer) every query, unless they
+	// share a fanout group, which only the ring captures can join
+	if (threads > 1 && args.count("mon") > 0 && args.count("ring") == 0)
+		return build_error("init: multiple threads in monitor mode need -P");
+	if (threads > 1 && args.count("pcap_in") > 0)
+		return build_error("init: a capture file is replayed by a single thread");
+
+	// All worker sockets bind the same address, or join the same fanout
+	// group when capturing, and the kernel spreads the flows across them.
+	map<string, string> wargs = args;
+	if (threads > 1) {
+		if (args.count("mon") > 0)
+			wargs["fanout"] = to_string(getpid() & 0xffff);
+		else
+			wargs["reuseport"] = "1";
+	}
 
-	if (io->init(args) < 0)
-		return build_error(string("init:") + io->why());
+	for (size_t i = 0; i < threads; ++i) {
+		worker *w = new (nothrow) worker();
+		if (!w)
+			return build_error("init: OOM");
+		w->id = i;
+		workers.push_back(w);
+
+		if (args.count("pcap_in") > 0)
+			w->io = new (nothrow) pcap_file_provider();
+		else if (args.count("laddr") > 0 && args.count("uring") > 0) {
+#ifdef QDNS_HAVE_URING
+			w->io = new (nothrow) uring_provider();
+#else
+			w->io = new (nothrow) socket_provider();
+#endif
+		} else if (args.count("laddr"))
+			w->io = new (nothrow) socket_provider();
+		else if (args.count("mon") > 0 && args.count("ring") > 0) {
+#ifdef QDNS_HAVE_TPACKET
+			w->io = new (nothrow) tpacket_provider();
+#else
+			return build_error("init: ring capture not supported on this platform");
+#endif
+		} else if (args.count("mon") > 0)
+			w->io = new (nothrow) usipp_provider();
+
+		if (!w->io)
+			return build_error("init: OOM");
+
+		if (w->io->init(wargs) < 0)
+			return build_error(string("init:") + w->io->why());
+	}
 
-	auto it = args.find("nxdomain");
-	if (it != args.end())
+	// TCP gets a worker of its own, next to the UDP ones
+	if (args.count("tcp") > 0) {
+		if (args.count("laddr") == 0)
+			return build_error("init: TCP is only served on a socket, not with -M or -r");
+#ifdef QDNS_HAVE_EPOLL
+		worker *w = new (nothrow) worker();
+		if (!w)
+			return build_error("init: OOM");
+		w->id = workers.size();
+		workers.push_back(w);
+
+		if (!(w->io = new (nothrow) tcp_provider()))
+			return build_error("init: OOM");
+		if (w->io->init(args) < 0)
+			return build_error(string("init:") + w->io->why());
+#else
+		return build_error("init: TCP not supported on this platform");
+#endif
+	}
+
+	if ((it = args.find("nxdomain")) != args.end())
 		nxdomain = (strtoul(it->second.c_str(), NULL, 10) != 0);
 	if (args.count("resend") > 0)
 		resend = 1;
+	if ((it = args.find("batch")) != args.end())
+		batch = strtoul(it->second.c_str(), NULL, 10);
+	if (batch == 0)
+		batch = 1;
+
+	// clients that got their TTL=1 answer, per worker
+	size_t once_size = 1<<16;
+	uint32_t once_expire = 3600;
+	unsigned prefix4 = 32, prefix6 = 128;
+	if ((it = args.find("once_size")) != args.end())
+		once_size = strtoul(it->second.c_str(), NULL, 10);
+	if ((it = args.find("once_expire")) != args.end())
+		once_expire = strtoul(it->second.c_str(), NULL, 10);
+	if ((it = args.find("once_prefix")) != args.end()) {
+		if (sscanf(it->second.c_str(), "%u/%u", &prefix4, &prefix6) < 1)
+			return build_error("init: invalid prefix lengths " + it->second);
+	}
+	for (auto w : workers) {
+		if (w->once.init(once_size, once_expire, prefix4, prefix6) < 0)
+			return build_error("init: OOM");
+	}
+
+	// response rate limiting, off unless a rate is given
+	uint32_t rrl_rate = 0, rrl_nxrate = 0, rrl_window = 15, rrl_slip = 2;
+	unsigned rrl_prefix4 = 24, rrl_prefix6 = 56;
+	if ((it = args.find("rrl_rate")) != args.end())
+		rrl_rate = rrl_nxrate = strtoul(it->second.c_str(), NULL, 10);
+	if ((it = args.find("rrl_nxrate")) != args.end())
+		rrl_nxrate = strtoul(it->second.c_str(), NULL, 10);
+	if ((it = args.find("rrl_window")) != args.end())
+		rrl_window = strtoul(it->second.c_str(), NULL, 10);
+	if ((it = args.find("rrl_slip")) != args.end())
+		rrl_slip = strtoul(it->second.c_str(), NULL, 10);
+	if ((it = args.find("rrl_prefix")) != args.end()) {
+		if (sscanf(it->second.c_str(), "%u/%u", &rrl_prefix4, &rrl_prefix6) < 1)
+			return build_error("init: invalid prefix lengths " + it->second);
+	}
+	if (rrl_rate > 0 || rrl_nxrate > 0) {
+		for (auto w : workers) {
+			if (w->rrl.init(1<<16, rrl_rate, rrl_nxrate, rrl_window, rrl_slip, rrl_prefix4, rrl_prefix6) < 0)
+				return build_error("init: OOM");
+		}
+	}
+
+	uint32_t sample = 1;
+	if ((it = args.find("logsample")) != args.end())
+		sample = strtoul(it->second.c_str(), NULL, 10);
+
+	// a few batches worth of records before the log thread must catch up
+	if (log.init(workers.size(), 4096, sample) < 0)
+		return build_error(string("init:") + log.why());
+
+	if ((it = args.find("stats")) != args.end()) {
+		vector<const worker_stats *> ws;
+		try {
+			for (auto w : workers)
+				ws.push_back(&w->st);
+		} catch (...) {
+			return build_error("init: OOM");
+		}
+		if (stats.init(it->second, ws) < 0)
+			return build_error(string("init:") + stats.why());
+	}
 
 	return 0;
 }
@@ -73,58 +211,228 @@ int qdns::init(const map<string, string> &args)
 
 int qdns::loop()
 {
-	if (!io)
+	if (workers.empty())
 		return build_error("loop: no IO provider initialized");
+	if (!z)
+		return build_error("loop: no zone loaded");
+
+	vector<thread> threads;
+
+	// SIGHUP is only taken by the reload thread, so block it before any
+	// thread is started, as they inherit the mask
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	if (pthread_sigmask(SIG_BLOCK, &hup, nullptr) != 0)
+		return build_error("loop: pthread_sigmask");
+
+	if (log.start() < 0)
+		return build_error(string("loop:") + log.why());
+	if (stats.start() < 0)
+		return build_error(string("loop:") + stats.why());
+
+	try {
+		for (size_t i = 1; i < workers.size(); ++i) {
+			worker *w = workers[i];
+			threads.push_back(thread([this, w]{ loop(w); }));
+		}
 
-	string log = "";
-	int r = 0;
+		// never returns, so it is not waited for once the workers are done
+		thread([this, hup]{
+			int sig = 0;
+			for (;;) {
+				if (sigwait(&hup, &sig) != 0)
+					continue;
+				if (reload() < 0)
+					cerr<<why()<<endl;
+			}
+		}).detach();
+	} catch (...) {
+		return build_error("loop: failed to start worker threads");
+	}
 
-	for (;;) {
-		client.pkt = "";
-		client.reply = "";
+	loop(workers[0]);
+
+	for (auto &t : threads)
+		t.join();
+
+	return 0;
+}
+
+
+int qdns::loop(worker *w)
+{
+	dns_provider *io = w->io;
+	query_log ql;
+	int r = 0, n = 0;
+
+	try {
+		w->msgs.resize(batch);
+	} catch (...) {
+		return build_error("loop: OOM");
+	}
 
-		if (io->recv(client.pkt) < 0) {
-			cerr<<io->why()<<endl;
+	vector<dns_msg> &msgs = w->msgs;
+
+	for (;;) {
+		if ((n = io->recv(msgs)) < 0) {
+			log.error(w->id, io->why());
 			continue;
 		}
-		src = io->sender();
-		r = parse_packet(client.pkt, client.reply, log);
+		if (n == 0 && io->done())
+			break;
 
-		if (r == 0) {
-			// return of 0 has reply equal pkt for resend
-			if (io->resend(client.reply) < 0) {
-				cerr<<src<<": "<<io->why()<<endl;
-				continue;
-			}
-		} else if (r > 0) {
-			if (io->reply(client.reply) < 0) {
-				cerr<<src<<": "<<io->why()<<endl;
+		auto received = chrono::steady_clock::now();
+		w->now = chrono::duration_cast<chrono::seconds>(received.time_since_epoch()).count();
+
+		// Announce which zones we may still use before looking at z, so
+		// that reload() either sees us or we see its new zone
+		w->epoch.store(zgen.load());
+		zone *cz = z.load();
+
+		// reloaded: start over, as a restart would
+		if (cz != w->z) {
+			try {
+				w->rr_pos.assign(cz->size(), 0);
+			} catch (...) {
+				w->epoch.store(0);
+				log.error(w->id, "loop: OOM");
 				continue;
 			}
-		} // in < 0 case, just log output
+			w->once.clear();
+			w->rrl.clear();
+			w->z = cz;
+		}
+
+		// handle the whole batch before flushing any replies
+		int replies = 0;
+		for (int i = 0; i < n; ++i) {
+			r = parse_packet(w, msgs[i], ql);
+
+			// return of 0 means resend the query itself
+			if (r == 0)
+				msgs[i].action = QDNS_MSG_RESEND;
+			else if (r > 0)
+				msgs[i].action = QDNS_MSG_REPLY;
+			else
+				msgs[i].action = QDNS_MSG_DROP;	// in < 0 case, just log output
 
-		cout<<src<<": "<<log<<endl;
+			log.query(w->id, io, msgs[i], ql);
+			w->st.count(msgs[i], ql);
+			if (msgs[i].action == QDNS_MSG_REPLY)
+				++replies;
+		}
+
+		if (io->reply(msgs, n) < 0) {
+			log.error(w->id, io->why());
+			w->st.add(QDNS_STAT_SEND_ERRORS);
+		}
+		if (io->resend(msgs, n) < 0) {
+			log.error(w->id, io->why());
+			w->st.add(QDNS_STAT_SEND_ERRORS);
+		}
+
+		if (replies > 0) {
+			auto sent = chrono::steady_clock::now();
+			w->st.latency_ns(chrono::duration_cast<chrono::nanoseconds>(sent - received).count(), replies);
+		}
+
+		w->epoch.store(0);
 	}
 
 	return 0;
 }
 
 
-int qdns::parse_packet(const string &query, string &response, string &log)
+// header flags in the third and fourth byte of the wire header that
+// are echoed from the query, and TC
+enum : uint8_t {
+	rd_bit = 0x01,
+	tc_bit = 0x02,
+	cd_bit = 0x10,
+	ad_bit = 0x20
+};
+
+
+// The OPT RR of our replies: root owner, our UDP payload size as class,
+// extended RCODE 0 or BADVERS, version 0, no flags and no options
+static const uint8_t opt_rr[] = {
+	0, 0, dns_type::OPT, dns_edns_size>>8, dns_edns_size & 0xff, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t opt_badvers_rr[] = {
+	0, 0, dns_type::OPT, dns_edns_size>>8, dns_edns_size & 0xff, 1, 0, 0, 0, 0, 0
+};
+
+
+// Walk the nrrs RRs that follow the question for an OPT RR (RFC 6891).
+// Returns -1 if they are malformed or there is more than one OPT, 0 if
+// there is none, and 1 with the OPT's class (the requestor's UDP
+// payload size) in size and its TTL field in ttl.
+static int find_opt(const char *ptr, const char *end_ptr, unsigned nrrs, uint16_t &size, uint32_t &ttl)
+{
+	int found = 0;
+
+	for (unsigned i = 0; i < nrrs; ++i) {
+		const char *name = ptr;
+
+		// owner: labels, ending in the root or a compression pointer
+		while (ptr < end_ptr && *ptr != 0 && (*ptr & 0xc0) != 0xc0) {
+			if ((uint8_t)*ptr > 63)
+				return -1;
+			ptr += (uint8_t)*ptr + 1;
+		}
+		if (ptr >= end_ptr)
+			return -1;
+		ptr += (*ptr == 0) ? 1 : 2;
+
+		net_headers::dns_rr rr;
+		if (ptr + sizeof(rr) > end_ptr)
+			return -1;
+		memcpy(&rr, ptr, sizeof(rr));
+		ptr += sizeof(rr);
+		if (ptr + ntohs(rr.len) > end_ptr)
+			return -1;
+		ptr += ntohs(rr.len);
+
+		if (rr.type != htons(dns_type::OPT))
+			continue;
+		if (found || name[0] != 0)
+			return -1;
+		found = 1;
+		size = ntohs(rr._class);
+		ttl = ntohl(rr.ttl);
+	}
+
+	return found;
+}
+
+
+// No heap allocations and no copies in here: the query is parsed in
+// place and the reply is left in msg as its precomputed header and
+// pointers to the question and RRs, see dns_msg
+int qdns::parse_packet(worker *w, dns_msg &msg, query_log &ql)
 {
 	using net_headers::dnshdr;
 	using net_headers::dns_type;
 
-	log = "invalid query";
-	response = "";
+	ql.flags = QDNS_LOG_INVALID;
+	ql.qname = nullptr;
+	ql.qname_len = 0;
+	ql.field = nullptr;
+	ql.field_len = 0;
+	ql.qtype = 0;
+	msg.rlen = 0;
 
-	if (query.size() <= sizeof(dnshdr))
+	const zone *z = w->z;
+
+	if (!msg.qbuf || msg.qlen <= sizeof(dnshdr))
 		return -1;
 
-	const char *ptr = query.c_str(), *end_ptr = ptr + query.size();
+	const char *query = msg.qbuf;
+	const char *ptr = query, *end_ptr = ptr + msg.qlen;
 
 	dnshdr hdr;
-	memcpy(&hdr, query.c_str(), sizeof(dnshdr));
+	memcpy(&hdr, query, sizeof(dnshdr));
 	ptr += sizeof(dnshdr);
 
 	// Huh? dst port 53 and no query?
@@ -135,10 +443,16 @@ int qdns::parse_packet(const string &query, string &response, string &log)
 	if (hdr.q_count != htons(1))
 		return -1;
 
-	// skip QNAME
+	// walk QNAME labels
 	auto qptr = ptr;
-	while (*ptr != 0 && ptr < end_ptr)
-		++ptr;
+	uint8_t l = 0;
+	while (ptr < end_ptr && (l = *ptr) != 0) {
+		if (l > 63)
+			return -1;
+		ptr += l + 1;
+	}
+	if (ptr >= end_ptr || ptr - qptr + 1 > 255)
+		return -1;
 	++ptr;
 
 	// must also have QTYPE and QCLASS
@@ -148,546 +462,799 @@ int qdns::parse_packet(const string &query, string &response, string &log)
 	uint16_t qtype = 0;
 	memcpy(&qtype, ptr, sizeof(qtype));
 
-	string qname = string(qptr, ptr - qptr);
-	string question = string(qptr, ptr + 2*sizeof(uint16_t) - qptr);
-	string fqdn = "";
+	size_t qname_len = ptr - qptr;
+	size_t question_len = qname_len + 2*sizeof(uint16_t);
 
-	if (qname2host(qname, fqdn) <= 0)
-		return -1;
-
-	switch (ntohs(qtype)) {
-	case dns_type::A:
-		log = "A? ";
-		break;
-	case dns_type::AAAA:
-		log = "AAAA? ";
-		break;
-	case dns_type::MX:
-		log = "MX? ";
-		break;
-	case dns_type::CNAME:
-		log = "CNAME? ";
-		break;
-	case dns_type::NS:
-		log = "NS? ";
-		break;
-	case dns_type::PTR:
-		log = "PTR? ";
-		break;
-	case dns_type::SRV:
-		log = "SRV? ";
-		break;
-	case dns_type::TXT:
-		log = "TXT? ";
-		break;
-	default:
-		char s[32];
-		snprintf(s, sizeof(s), "%d? ", ntohs(qtype));
-		log = s;
+	// EDNS0, if there is an OPT among the RRs after the question
+	uint16_t opt_size = 0;
+	uint32_t opt_ttl = 0;
+	int edns = 0;
+	if (hdr.a_count != 0 || hdr.rra_count != 0 || hdr.ad_count != 0) {
+		unsigned nrrs = ntohs(hdr.a_count) + ntohs(hdr.rra_count) + ntohs(hdr.ad_count);
+		if ((edns = find_opt(qptr + question_len, end_ptr, nrrs, opt_size, opt_ttl)) < 0)
+			return -1;
 	}
 
-	log += fqdn;
-	log += " -> ";
+	// the largest UDP reply the requestor takes
+	size_t udp_max = 512;
+	if (edns && opt_size > udp_max)
+		udp_max = opt_size;
+
+	ql.flags = 0;
+	ql.qname = qptr;
+	ql.qname_len = qname_len;
+	ql.qtype = ntohs(qtype);
+
+	msg.rq = qptr;
+	msg.rq_len = question_len;
+	msg.ropt = nullptr;
+	msg.ropt_len = 0;
+
+	if (edns) {
+		ql.flags |= QDNS_LOG_EDNS;
+		msg.ropt = reinterpret_cast<const char *>(opt_rr);
+		msg.ropt_len = sizeof(opt_rr);
+
+		// we only speak version 0, tell so with no answer at all
+		if ((opt_ttl>>16) & 0xff) {
+			ql.flags |= QDNS_LOG_BADVERS;
+			memset(msg.rhdr, 0, sizeof(msg.rhdr));
+			msg.rhdr[0] = query[0];
+			msg.rhdr[1] = query[1];
+			msg.rhdr[2] = 0x80 | (query[2] & rd_bit);
+			msg.rhdr[5] = 1;	// question
+			msg.rhdr[11] = 1;	// OPT
+			msg.rrs = nullptr;
+			msg.rrs_len = 0;
+			msg.ropt = reinterpret_cast<const char *>(opt_badvers_rr);
+			msg.rlen = sizeof(msg.rhdr) + question_len + sizeof(opt_badvers_rr);
+			return 1;
+		}
+	}
 
-	bool found_domain = 1;
-	auto it1 = exact_matches.find(make_pair(qname, qtype)), lit = it1;
+	bool found_domain = 1, wildcard = 0;
 
-	if (lit == exact_matches.end()) {
-		string::size_type pos = string::npos, minpos = string::npos;
-
-		// try to find largest substring match
-		for (auto it2 = wild_matches.begin(); it2 != wild_matches.end(); ++it2) {
-			if ((pos = qname.find(it2->first.first)) == string::npos || it2->first.second != qtype)
-				continue;
-			if (pos < minpos && pos + it2->first.first.size() == qname.size()) {
-				minpos = pos;
-				lit = it2;
-			}
-		}
+	// random names of a flood mostly fail the zone's filters without
+	// a lookup, and go straight to the NXDOMAIN answer
+	uint16_t view = z->view(msg.peer);
+	uint32_t id = z->find(qptr, qname_len, qtype, view, wildcard);
+	if (wildcard)
+		ql.flags |= QDNS_LOG_WILD;
 
+	if (id == zone::npos) {
 		// If no entry found, NXDOMAIN
-		if (minpos == string::npos) {
-			found_domain = 0;
-			log += "NDXOMAIN ";
-			auto it3 = exact_matches.find(make_pair(string("\x9[forward]\0", 11), htons(dns_type::SOA)));
-			if (it3 != exact_matches.end())
-				lit = it3;
-
-			// if -R was given, we are firewalling router,
-			// so resend in case we cant resolve ourself
-			if (resend) {
-				log += "(resend)";
-				response = query;
-				return 0;
-			}
+		found_domain = 0;
+		ql.flags |= QDNS_LOG_NXDOMAIN;
+		id = z->forward(view);
+
+		// if -R was given, we are firewalling router,
+		// so resend in case we cant resolve ourself
+		if (resend) {
+			ql.flags |= QDNS_LOG_RESEND;
+			return 0;
+		}
 
-			// NXDOMAIN answers prohibited (-X)
-			if (!nxdomain) {
-				log += "(nosend)";
-				return -1;
-			}
+		// NXDOMAIN answers prohibited (-X)
+		if (!nxdomain) {
+			ql.flags |= QDNS_LOG_NOSEND;
+			return -1;
 		}
 	}
 
 	// still nothing found?
-	if (lit == exact_matches.end()) {
-		log += "no [forward], (nosend)";
+	if (id == zone::npos) {
+		ql.flags |= QDNS_LOG_NOFWD;
 		return -1;
 	}
 
-	// map wasnt changed, so lit iterator still valid
-	list<match *> &l = lit->second;
-
-	if (l.size() == 0) {
-		log += "NULL match. Missing -X?";
-		return -1;
+	// Rate limit what goes out by datagram, per client network and
+	// class of response. Dropped and slipped replies don't count as the TTL=1
+	// answer of a client.
+	bool slip = 0;
+	if (w->rrl.enabled() && !w->io->stream()) {
+		rrl_class c = !found_domain ? QDNS_RRL_NXDOMAIN : ((ql.flags & QDNS_LOG_WILD) ? QDNS_RRL_WILDCARD : QDNS_RRL_ANSWER);
+		switch (w->rrl.check(msg.peer, c, w->now)) {
+		case QDNS_RRL_DROP:
+			ql.flags |= QDNS_LOG_RRL_DROP;
+			return -1;
+		case QDNS_RRL_SLIP:
+			ql.flags |= QDNS_LOG_RRL_SLIP;
+			slip = 1;
+			break;
+		default:
+			break;
+		}
 	}
 
-	match *m = l.front();
+	const zone::rrset &rs = z->set(id);
+	uint32_t &pos = w->rr_pos[id];
+	const zone::answer &m = z->get(rs, pos);
 
 	// TTL of 1 means, only handle this client src once
-	if (l.size() == 1 && m->ttl == htonl(1)) {
-		if (once.count(src) > 0) {
-			log += "(once, nosend)";
+	if (rs.count == 1 && m.ttl == htonl(1) && !slip) {
+		if (!w->once.insert(msg.peer, w->io->once_port(), w->now)) {
+			ql.flags |= QDNS_LOG_ONCE;
 			return -1;
 		}
-		once[src] = 1;
-	}
-
-	log += m->field;
-
-	// reply-hdr
-	dnshdr rhdr;
-	memcpy(&rhdr, &hdr, sizeof(hdr));
-	rhdr.qr = 1;
-	rhdr.aa = 0;
-	rhdr.tc = 0;
-	rhdr.ra = 0;
-	rhdr.unused = 0;
-	if (!found_domain)
-		rhdr.rcode = 3;
-	else
-		rhdr.rcode = 0;
-	rhdr.q_count = hdr.q_count;
-	rhdr.a_count = m->a_count;
-	rhdr.rra_count = m->rra_count;
-	rhdr.ad_count = m->ad_count;
-
-	response = string((char *)&rhdr, sizeof(rhdr));
-	response += question;
-	response += m->rr;
-
-	// shift list of matches. l is a ref to the list inside
-	// the map, so the change really happens
-	if (l.size() > 1) {
-		l.push_back(m);
-		l.pop_front();
 	}
 
+	ql.field = z->data(m.field_off);
+	ql.field_len = m.field_len;
+
+	if (sizeof(dnshdr) + question_len + m.rr_len + msg.ropt_len > dns_max_reply) {
+		ql.flags |= QDNS_LOG_TOOBIG;
+		return -1;
+	}
+
+	// reply-hdr is the answer's template with the ID, RD, AD and CD
+	// bits of the query; opcode is 0 as checked above
+	char *rhdr = msg.rhdr;
+	memcpy(rhdr, m.hdr, sizeof(m.hdr));
+	rhdr[0] = query[0];
+	rhdr[1] = query[1];
+	rhdr[2] |= query[2] & rd_bit;
+	rhdr[3] = (query[3] & (ad_bit|cd_bit)) | (found_domain ? 0 : 3);
+
+	// the OPT goes last, into the additional section
+	if (msg.ropt_len) {
+		uint16_t ad_count = 0;
+		memcpy(&ad_count, rhdr + 10, sizeof(ad_count));
+		ad_count = htons(ntohs(ad_count) + 1);
+		memcpy(rhdr + 10, &ad_count, sizeof(ad_count));
+	}
+
+	// question and RRs are sent from where they are
+	msg.rrs = z->data(m.rr_off);
+	msg.rrs_len = m.rr_len;
+	msg.rlen = sizeof(m.hdr) + question_len + m.rr_len + msg.ropt_len;
+
+	// Too large for one datagram to this peer, or slipped by RRL: only
+	// the question, with TC set, so that it asks again over TCP
+	if (slip || (msg.rlen > udp_max && !w->io->stream())) {
+		if (!slip)
+			ql.flags |= QDNS_LOG_TC;
+		rhdr[2] |= tc_bit;
+		memset(rhdr + 6, 0, 6);
+		if (msg.ropt_len)
+			rhdr[11] = 1;
+		msg.rrs = nullptr;
+		msg.rrs_len = 0;
+		msg.rlen = sizeof(m.hdr) + question_len + msg.ropt_len;
+	}
+
+	// next query of this worker gets the next match
+	if (rs.count > 1 && ++pos == rs.count)
+		pos = 0;
+
 	return 1;
 }
 
 
 
-// beware: this function can overflow stack, if you place too many
-// CNAMEs into the zone file.
+// turn the parsed matches into the flat zone that is served
+int qdns::compile_zone(const vector<match> &matches, const vector<view_matches> &views, zone *&result)
+{
+	zone *nz = new (nothrow) zone();
+	if (!nz)
+		return build_error("compile_zone: OOM");
+
+	for (size_t v = 0; v < views.size(); ++v) {
+		for (auto mm : {&views[v].exact, &views[v].wild}) {
+			for (auto it = mm->begin(); it != mm->end(); ++it) {
+				for (auto i : it->second) {
+					const match &m = matches[i];
+					if (nz->add_answer(m.rr, m.field, m.ttl, m.a_count, m.rra_count, m.ad_count) < 0) {
+						delete nz;
+						return build_error("compile_zone: failed to add " + m.fqdn);
+					}
+				}
+				if (nz->add_rrset(it->first.first, it->first.second, mm == &views[v].wild, v) < 0) {
+					delete nz;
+					return build_error("compile_zone: failed to index " + matches[it->second[0]].fqdn);
+				}
+			}
+		}
+		for (auto &n : views[v].nets) {
+			if (nz->add_network(n.family, n.addr, n.len, v) < 0) {
+				delete nz;
+				return build_error("compile_zone: OOM");
+			}
+		}
+	}
+
+	if (nz->finish() < 0) {
+		delete nz;
+		return build_error("compile_zone: OOM");
+	}
+
+	result = nz;
+	return 0;
+}
+
+
+int qdns::save_zone(const string &file)
+{
+	zone *cz = z.load();
+	if (!cz)
+		return build_error("save_zone: no zone loaded");
+	if (cz->save(file) < 0)
+		return build_error("save_zone: " + file);
+	return 0;
+}
+
+
+// before serving
 int qdns::parse_zone(const string &file)
 {
-	FILE *f = fopen(file.c_str(), "r");
-	if (!f)
-		return build_error("parse_zone: fopen");
-
-	char buf[1024], *ptr = NULL, name[256], type[256], ltype[256], ttlb[255], field[256], rr[1024], *rr_ptr = NULL;
-	uint16_t off = 0, rlen = 0, zero = 0, dtype = 0, dltype = 0, dclass = htons(1), prio = 0, weight = 0;
-	uint32_t ttl = 0, records = 0;
-	uint32_t soa_ints[5] = {0x11223344, htonl(7200), htonl(7200), htonl(3600000), htonl(7200)};
-	string dname = "", link_rr = "", dlname = "";
-	net_headers::dns_srv_rr srv;
-	map<string, string> A, AAAA;
-	enum {
-		RR_KIND_MATCHING	= 0,
-		RR_KIND_LINKING		= 1
-	} rr_kind = RR_KIND_MATCHING;
+	zone *nz = nullptr;
+	if (read_zone(file, nz) < 0)
+		return -1;
+	delete z.exchange(nz);
+	zfile = file;
+	return 0;
+}
 
-	// a compressed label, pointing right to original QNAME, so
-	// that even on wildcard matches, we already have a full blown
-	// answer RR in place, even without knowing the exact QNAME in advance
-	uint16_t clbl = htons(((1<<15)|(1<<14))|sizeof(net_headers::dnshdr));
 
-	memset(buf, 0, sizeof(buf));
-	memset(name, 0, sizeof(name));
-	memset(ltype, 0, sizeof(ltype));
-	memset(type, 0, sizeof(type));
-	memset(ttlb, 0, sizeof(ttlb));
-	memset(field, 0, sizeof(field));
+// The new zone is built while the workers keep serving the old one.
+// After the swap, each worker is either between batches or within one
+// that began with the new zone, or we wait for it to finish its batch;
+// then nobody can hold the old zone anymore.
+int qdns::reload()
+{
+	if (zfile == "/dev/stdin")
+		return build_error("reload: zone was read from stdin");
 
-	while (fgets(buf, sizeof(buf), f)) {
+	zone *nz = nullptr;
+	if (read_zone(zfile, nz) < 0)
+		return -1;
 
-		if (rr_kind == RR_KIND_MATCHING) {
-			link_rr = "";
-			dltype = 0;
-		}
+	zone *old = z.exchange(nz);
+	uint64_t gen = ++zgen;
 
-		memset(rr, 0, sizeof(rr));
-		rr_ptr = rr;
-		dname = "";
-		dlname = "";
+	for (auto w : workers) {
+		uint64_t e = 0;
+		while ((e = w->epoch.load()) != 0 && e < gen)
+			this_thread::sleep_for(chrono::milliseconds(1));
+	}
 
-		ptr = buf;
-		while (*ptr == ' ' || *ptr == '\t')
-			++ptr;
-		if (*ptr == ';' || *ptr == '\n')
-			continue;
+	delete old;
+	return 0;
+}
 
-		// link following entry to already existing RR?
-		if (*ptr == '@') {
-			// wrong format? ignore!
-			if (sscanf(ptr + 1, "%255[^ \t]%*[ \t]%255[^ \t;\n]", name, ltype) != 2)
-				link_rr = "";
-			else {
-				link_rr = name;
-				rr_kind = RR_KIND_LINKING;
-			}
+
+namespace {
+
+// One line of a zone file that is a record, an "@name type" link
+// directive or a "[view] network ..." line, as a loader thread turns
+// it into wire format. Comments, empty lines and lines that do not
+// parse are left out.
+struct zone_line {
+	bool link;
+	bool view;		// field has the networks
+	bool ok;		// link: it parsed; record: name, type and RR data are fine
+	bool wild;		// record: name starts with "*"
+	uint16_t type;		// network order; of the linked RR for links, 0 if unknown
+	uint32_t ttl;		// network order
+	std::string name;	// wire format; the linked one for links, "" if invalid
+	std::string owner;	// records: name without a leading "*", "" if invalid
+	std::string fqdn, field;
+	std::string rr;		// records: type, class, TTL, length and RDATA
+
+	zone_line() : link(0), view(0), ok(0), wild(0), type(0), ttl(0)
+	{}
+};
+
+}
+
+
+// What sscanf's "%255[^stop]" takes: 1 to 255 chars before one of
+// stop, the end of the line or a NUL. A longer one ends after 255.
+static bool scan_token(const char *&ptr, const char *eol, const char *stop, string &tok)
+{
+	const char *start = ptr;
+
+	while (ptr < eol && ptr - start < 255 && *ptr != 0 && !strchr(stop, *ptr))
+		++ptr;
+	if (ptr == start)
+		return 0;
+	tok.assign(start, ptr - start);
+	return 1;
+}
+
+
+// "%*[ \t]"
+static bool skip_blanks(const char *&ptr, const char *eol)
+{
+	const char *start = ptr;
+
+	while (ptr < eol && (*ptr == ' ' || *ptr == '\t'))
+		++ptr;
+	return ptr > start;
+}
+
+
+// network order, 0 if unknown
+static uint16_t rr_type(const string &type)
+{
+	using net_headers::dns_type;
+
+	static const struct {
+		const char *name;
+		uint16_t type;
+	} types[] = {
+		{"A", dns_type::A}, {"MX", dns_type::MX}, {"AAAA", dns_type::AAAA}, {"NS", dns_type::NS},
+		{"CNAME", dns_type::CNAME}, {"SOA", dns_type::SOA}, {"SRV", dns_type::SRV},
+		{"TXT", dns_type::TXT}, {"PTR", dns_type::PTR}
+	};
+
+	for (auto &t : types) {
+		if (strcasecmp(type.c_str(), t.name) == 0)
+			return htons(t.type);
+	}
+	return 0;
+}
+
+
+// host2qname(), and no longer than a DNS name. Plain names are
+// encoded right here, the odd ones with empty or overlong labels the
+// way host2qname() does.
+static bool encode_name(const string &host, string &qname)
+{
+	size_t n = host.size(), label = 0;
+
+	if (n == 0 || n + 2 > 255 || host[0] == '.' || host[n - 1] == '.')
+		return host2qname(host, qname) > 0 && qname.size() <= 255;
+
+	qname.resize(n + 2);
+	for (size_t i = 0; i <= n; ++i) {
+		if (i < n && host[i] != '.') {
+			qname[i + 1] = host[i];
 			continue;
 		}
+		if (i - label == 0 || i - label > 63)
+			return host2qname(host, qname) > 0 && qname.size() <= 255;
+		qname[label] = i - label;
+		label = i + 1;
+	}
+	qname[n + 1] = 0;
+	return 1;
+}
 
-		if (sscanf(ptr, "%255[^ \t]%*[ \t]%255[^ \t]%*[ \t]IN%*[ \t]%255[^ \t]%*[ \t]%255[^ \t;\n]", name, ttlb, type, field) != 4)
-			continue;
 
-		// the next loop cycle we assume matching RR's until we find @ again.
-		// this is to reset link_rr on loop start
-		rr_kind = RR_KIND_MATCHING;
+// The record's RR as it is sent, but for the owner name: type, class,
+// TTL, length and RDATA. false if field does not make RDATA of that type.
+static bool encode_rr(uint16_t dtype, uint32_t ttl, const string &field, string &rr)
+{
+	using net_headers::dns_type;
+
+	static const uint32_t soa_ints[5] = {0x11223344, htonl(7200), htonl(7200), htonl(3600000), htonl(7200)};
+	char rdata[1024], *ptr = rdata;
+	uint16_t zero = 0, dclass = htons(1);
+	string dname = "";
 
-		//cout<<"Parsed: "<<name<<"<->"<<type<<"<->"<<ttlb<<"<->"<<field<<endl;
+	switch (ntohs(dtype)) {
+	case dns_type::A:
+		in_addr in;
+		if (inet_pton(AF_INET, field.c_str(), &in) != 1)
+			return 0;
+		memcpy(ptr, &in, sizeof(in));
+		ptr += sizeof(in);
+		break;
+	case dns_type::AAAA:
+		in6_addr in6;
+		if (inet_pton(AF_INET6, field.c_str(), &in6) != 1)
+			return 0;
+		memcpy(ptr, &in6, sizeof(in6));
+		ptr += sizeof(in6);
+		break;
+	case dns_type::MX:
+		if (!encode_name(field, dname))
+			return 0;
+		memcpy(ptr, &zero, sizeof(zero));		// preference
+		ptr += sizeof(zero);
+		memcpy(ptr, dname.c_str(), dname.size());
+		ptr += dname.size();
+		break;
+	// TXT and PTR data are encoded like names
+	case dns_type::NS:
+	case dns_type::CNAME:
+	case dns_type::TXT:
+	case dns_type::PTR:
+		if (!encode_name(field, dname))
+			return 0;
+		memcpy(ptr, dname.c_str(), dname.size());
+		ptr += dname.size();
+		break;
+	case dns_type::SOA:
+		if (!encode_name(field, dname))
+			return 0;
+		memcpy(ptr, dname.c_str(), dname.size());
+		ptr += dname.size();
+		memcpy(ptr, dname.c_str(), dname.size());
+		ptr += dname.size();
+		memcpy(ptr, soa_ints, sizeof(soa_ints));
+		ptr += sizeof(soa_ints);
+		break;
+	// target:prio:weight:port
+	case dns_type::SRV: {
+		string::size_type colon = field.find(':');
+		if (colon == 0 || colon == string::npos || colon > 255)
+			return 0;
+
+		uint16_t v[3];
+		const char *num = field.c_str() + colon;
+		for (int i = 0; i < 3; ++i) {
+			char *end = nullptr;
+			if (*num != ':')
+				return 0;
+			v[i] = htons(strtoul(num + 1, &end, 10));
+			if (end == num + 1)
+				return 0;
+			num = end;
+		}
 
-		if (host2qname(name, dname) <= 0)
-			continue;
-		if (dname.size() > 255)
-			continue;
+		if (!encode_name(field.substr(0, colon), dname))
+			return 0;
+		memcpy(ptr, v, sizeof(v));
+		ptr += sizeof(v);
+		memcpy(ptr, dname.c_str(), dname.size());
+		ptr += dname.size();
+		break;
+	}
+	default:
+		return 0;
+	}
 
-		// DNS type of current entry
-		if (strcasecmp(type, "A") == 0) {
-			dtype = htons(dns_type::A);
-		} else if (strcasecmp(type, "MX") == 0) {
-			dtype = htons(dns_type::MX);
-		} else if (strcasecmp(type, "AAAA") == 0) {
-			dtype = htons(dns_type::AAAA);
-		} else if (strcasecmp(type, "NS") == 0) {
-			dtype = htons(dns_type::NS);
-		} else if (strcasecmp(type, "CNAME") == 0) {
-			dtype = htons(dns_type::CNAME);
-		} else if (strcasecmp(type, "SOA") == 0) {
-			dtype = htons(dns_type::SOA);
-		} else if (strcasecmp(type, "SRV") == 0) {
-			dtype = htons(dns_type::SRV);
-		} else if (strcasecmp(type, "TXT") == 0) {
-			dtype = htons(dns_type::TXT);
-		} else if (strcasecmp(type, "PTR") == 0) {
-			dtype = htons(dns_type::PTR);
-		} else
-			continue;
+	uint16_t rlen = htons(ptr - rdata);
 
-		ttl = htonl(strtoul(ttlb, NULL, 10));
+	rr.clear();
+	rr.append(reinterpret_cast<const char *>(&dtype), sizeof(dtype));
+	rr.append(reinterpret_cast<const char *>(&dclass), sizeof(dclass));
+	rr.append(reinterpret_cast<const char *>(&ttl), sizeof(ttl));
+	rr.append(reinterpret_cast<const char *>(&rlen), sizeof(rlen));
+	rr.append(rdata, ptr - rdata);
+	return 1;
+}
+
+
+// Turn the lines in [ptr, end) into zone_lines. Nothing in here
+// depends on other lines, so chunks of a file are parsed in parallel;
+// the links are resolved when the chunks are merged in order.
+static int parse_lines(const char *ptr, const char *end, vector<zone_line> &lines)
+{
+	string name = "", ttlb = "", type = "";
 
-		match *m = nullptr;
+	try {
+		for (const char *eol = ptr; ptr < end; ptr = eol + 1) {
+			if (!(eol = static_cast<const char *>(memchr(ptr, '\n', end - ptr))))
+				eol = end;
 
-		// use already existing match if linked to existing RR
-		if (link_rr.size() > 0) {
-			if (host2qname(link_rr, dlname) <= 0)
+			while (ptr < eol && (*ptr == ' ' || *ptr == '\t'))
+				++ptr;
+			if (ptr == eol || *ptr == ';')
 				continue;
 
-			// DNS type of RR which we link to
-			if (strcasecmp(ltype, "A") == 0) {
-				dltype = htons(dns_type::A);
-			} else if (strcasecmp(ltype, "MX") == 0) {
-				dltype = htons(dns_type::MX);
-			} else if (strcasecmp(ltype, "AAAA") == 0) {
-				dltype = htons(dns_type::AAAA);
-			} else if (strcasecmp(ltype, "NS") == 0) {
-				dltype = htons(dns_type::NS);
-			} else if (strcasecmp(ltype, "CNAME") == 0) {
-				dltype = htons(dns_type::CNAME);
-			} else if (strcasecmp(ltype, "SOA") == 0) {
-				dltype = htons(dns_type::SOA);
-			} else if (strcasecmp(ltype, "SRV") == 0) {
-				dltype = htons(dns_type::SRV);
-			} else if (strcasecmp(ltype, "TXT") == 0) {
-				dltype = htons(dns_type::TXT);
-			} else if (strcasecmp(ltype, "PTR") == 0) {
-				dltype = htons(dns_type::PTR);
-			} else
+			zone_line l;
+
+			// link following entry to already existing RR?
+			if (*ptr == '@') {
+				l.link = 1;
+				++ptr;
+				l.ok = scan_token(ptr, eol, " \t", name) && skip_blanks(ptr, eol) &&
+				       scan_token(ptr, eol, " \t;", type);
+				if (l.ok && (l.type = rr_type(type)) != 0 && !encode_name(name, l.name))
+					l.name = "";
+				lines.push_back(move(l));
 				continue;
+			}
 
-			if (exact_matches.count(make_pair(dlname, dltype)) > 0)
-				m = exact_matches.find(make_pair(dlname, dltype))->second.back();
-			else if (wild_matches.count(make_pair(dlname, dltype)) > 0)
-				m = wild_matches.find(make_pair(dlname, dltype))->second.back();
-			else
+			// the networks are taken apart when merging, as views are few
+			if (eol - ptr >= 6 && memcmp(ptr, "[view]", 6) == 0 &&
+			    (eol - ptr == 6 || ptr[6] == ' ' || ptr[6] == '\t' || ptr[6] == ';')) {
+				const char *c = static_cast<const char *>(memchr(ptr, ';', eol - ptr));
+				l.view = l.ok = 1;
+				l.field.assign(ptr + 6, (c ? c : eol) - (ptr + 6));
+				lines.push_back(move(l));
 				continue;
+			}
 
-			// Can't use compression here, since its maybe an unrelated name.
-			// Use (current) dname, not dlname.
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-		} else {
-			m = new match;
+			// name ttl IN type field
+			if (!scan_token(ptr, eol, " \t", name) || !skip_blanks(ptr, eol) ||
+			    !scan_token(ptr, eol, " \t", ttlb) || !skip_blanks(ptr, eol) ||
+			    eol - ptr < 2 || ptr[0] != 'I' || ptr[1] != 'N' || !skip_blanks(ptr += 2, eol) ||
+			    !scan_token(ptr, eol, " \t", type) || !skip_blanks(ptr, eol) ||
+			    !scan_token(ptr, eol, " \t;", l.field))
+				continue;
 
-			// keep a human readable copy of answer for later logging
-			m->field = field;
+			l.type = rr_type(type);
+			l.ttl = htonl(strtoul(ttlb.c_str(), NULL, 10));
+			l.fqdn = name;
+			l.ok = encode_name(name, l.name) && l.type != 0 && encode_rr(l.type, l.ttl, l.field, l.rr);
 
+			// Wildcards match on label boundaries: "*.foo.com" and
+			// "*foo.com" both answer foo.com and everything below it
 			if (name[0] == '*') {
-				off = 1;
-				if (name[1] == '.')
-					off = 2;
-				memmove(name, name + off, sizeof(name) - off);
-				m->mtype = QDNS_MATCH_WILD;
-
-				// we changed 'name' array, so we need to encode again
-				if (host2qname(name, dname) <= 0)
-					continue;
-				if (dname.size() > 255)
-					continue;
-
-				// wildcard matches have wrong byte-count in front
-				dname.erase(0, 1);
+				l.wild = 1;
+				l.fqdn = name.substr(name.size() > 1 && name[1] == '.' ? 2 : 1);
+				if (!encode_name(l.fqdn, l.owner))
+					l.owner = "";
 			} else
-				m->mtype = QDNS_MATCH_EXACT;
+				l.owner = l.name;
+
+			lines.push_back(move(l));
+		}
+	} catch (...) {
+		return -1;
+	}
+	return 0;
+}
 
-			// start constructing answer section RR's. See above comment
-			// for compressed label ptr
-			memcpy(rr_ptr, &clbl, sizeof(clbl));
-			rr_ptr += sizeof(clbl);
 
-			m->fqdn = name;
+// "address/len", or an address alone for just that host. The host
+// bits are cleared, so that equal networks compare equal.
+static bool parse_net(const string &net, int &family, uint8_t *addr, unsigned &len)
+{
+	string::size_type slash = net.find('/');
+	string a = net.substr(0, slash);
+
+	family = a.find(':') == string::npos ? AF_INET : AF_INET6;
+	if (inet_pton(family, a.c_str(), addr) != 1)
+		return 0;
+
+	unsigned max = family == AF_INET ? 32 : 128;
+	len = max;
+	if (slash != string::npos) {
+		const char *num = net.c_str() + slash + 1;
+		char *end = nullptr;
+		if (*num < '0' || *num > '9')
+			return 0;
+		unsigned long l = strtoul(num, &end, 10);
+		if (*end != 0 || l > max)
+			return 0;
+		len = l;
+	}
 
-			// DNS encoded name
-			m->name = dname;
+	for (unsigned i = len; i < max; ++i)
+		addr[i/8] &= ~(0x80>>(i % 8));
+	return 1;
+}
 
-			// TTL
-			m->ttl = ttl;
 
-			m->type = dtype;
-			m->a_count = 0;
-			m->ad_count = 0;
-			m->rra_count = 0;
+int qdns::read_zone(const string &file, zone *&result)
+{
+	// precompiled via -C, just map it
+	if (zone::is_image(file)) {
+		zone *nz = new (nothrow) zone();
+		if (!nz)
+			return build_error("read_zone: OOM");
+		if (nz->load(file) < 0) {
+			delete nz;
+			return build_error("read_zone: failed to load zone image " + file);
 		}
+		result = nz;
+		cout<<"Successfully mapped "<<nz->size()<<" Quantum-RRsets.\n";
+		return 0;
+	}
 
-		uint16_t prt = 0;
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return build_error("read_zone: open");
+
+	// files are mapped, pipes such as /dev/stdin read
+	struct stat st;
+	string piped = "";
+	const char *text = nullptr;
+	size_t len = 0;
+	void *map = MAP_FAILED;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		len = st.st_size;
+		if (len > 0 && (map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			close(fd);
+			return build_error("read_zone: mmap");
+		}
+		text = static_cast<const char *>(map);
+	} else {
+		char buf[1<<16];
+		ssize_t r = 0;
+		try {
+			while ((r = read(fd, buf, sizeof(buf))) != 0) {
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r < 0)
+					break;
+				piped.append(buf, r);
+			}
+		} catch (...) {
+			r = -1;
+		}
+		if (r < 0) {
+			close(fd);
+			return build_error("read_zone: read");
+		}
+		text = piped.c_str();
+		len = piped.size();
+	}
+	close(fd);
+
+	// a chunk per core, of at least 1MB, each ending at a line end
+	size_t nchunks = thread::hardware_concurrency();
+	if (nchunks == 0)
+		nchunks = 1;
+	while (nchunks > 1 && len/nchunks < (1<<20))
+		--nchunks;
+
+	vector<const char *> bounds(nchunks + 1, text + len);
+	vector<vector<zone_line>> chunks(nchunks);
+	vector<int> parsed(nchunks, 0);
+	bounds[0] = text;
+	for (size_t i = 1; i < nchunks; ++i) {
+		const char *b = text + i*(len/nchunks);
+		if (b < bounds[i - 1])
+			b = bounds[i - 1];
+		const char *nl = static_cast<const char *>(memchr(b, '\n', text + len - b));
+		bounds[i] = nl ? nl + 1 : text + len;
+	}
 
-		switch (ntohs(dtype)) {
-		case dns_type::A:
-			in_addr in;
-			if (inet_pton(AF_INET, field, &in) != 1)
-				continue;
-			// construct RR as per RFC
-			rlen = htons(4);
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, &in, sizeof(in));
-			rr_ptr += sizeof(in);
+	// the first chunk is done by this thread, also if no thread starts
+	vector<thread> loaders;
+	for (size_t i = 1; i < nchunks; ++i) {
+		try {
+			loaders.push_back(thread([&, i]{ parsed[i] = parse_lines(bounds[i], bounds[i + 1], chunks[i]); }));
+		} catch (...) {
+			parsed[i] = parse_lines(bounds[i], bounds[i + 1], chunks[i]);
+		}
+	}
+	parsed[0] = parse_lines(bounds[0], bounds[1], chunks[0]);
+	for (auto &t : loaders)
+		t.join();
+
+	if (map != MAP_FAILED)
+		munmap(map, len);
+	for (auto r : parsed) {
+		if (r < 0)
+			return build_error("read_zone: OOM");
+	}
 
-			// If we are linking against a SOA, reverse order since
-			// Authority comes after answer section. dltype is the dtype of
-			// the RR we are linking to (if any, otherwise its 0)
-			if (dltype == htons(dns_type::SOA))
-				m->rr = string(rr, rr_ptr - rr) + m->rr;
-			else
-				m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
+	// a compressed label, pointing right to original QNAME, so
+	// that even on wildcard matches, we already have a full blown
+	// answer RR in place, even without knowing the exact QNAME in advance
+	uint16_t clbl = htons(((1<<15)|(1<<14))|sizeof(net_headers::dnshdr));
+	const string compressed(reinterpret_cast<const char *>(&clbl), sizeof(clbl));
+
+	vector<match> matches;
+	vector<view_matches> views(1);
+	uint32_t records = 0;
+
+	// A "[view] network ..." line puts the records after it into the
+	// view of these networks, a "[view]" alone back into view 0. Views
+	// are told apart by their set of networks, so a view may have
+	// several sections.
+	std::map<string, uint16_t> view_ids;
+	uint16_t view = 0;
+
+	// An "@name type" line links the RRs of the next record to the
+	// last one of that name and type before it, for the record's
+	// name in full, or to nothing if it is invalid. Only a record
+	// uses up a link; a line that does not parse doesn't.
+	const zone_line *link = nullptr;
+
+	// the parsed lines are used up as they are merged
+	for (auto &chunk : chunks) {
+		for (auto &l : chunk) {
+			if (l.view) {
+				link = nullptr;
+
+				vector<client_net> nets;
+				vector<string> keys;
+				const char *ptr = l.field.c_str(), *end = ptr + l.field.size();
+				string net = "";
+				while (skip_blanks(ptr, end), scan_token(ptr, end, " \t", net)) {
+					client_net n;
+					memset(&n, 0, sizeof(n));
+					if (!parse_net(net, n.family, n.addr, n.len)) {
+						errno = 0;
+						return build_error("read_zone: invalid network " + net);
+					}
+					nets.push_back(n);
+					keys.push_back(string(reinterpret_cast<const char *>(&n), sizeof(n)));
+				}
+
+				if (nets.empty()) {
+					view = 0;
+					continue;
+				}
 
-		case dns_type::MX:
-			if (host2qname(field, dname) <= 0)
-				continue;
-			if (dname.size() > 255)
-				continue;
-			rlen = htons(dname.size() + sizeof(uint16_t));
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, &zero, sizeof(zero));		// preference
-			rr_ptr += sizeof(zero);
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			if (dltype == htons(dns_type::SOA))
-				m->rr = string(rr, rr_ptr - rr) + m->rr;
-			else
-				m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
+				sort(keys.begin(), keys.end());
+				keys.erase(unique(keys.begin(), keys.end()), keys.end());
+				string key = "";
+				for (auto &k : keys)
+					key += k;
 
-		case dns_type::AAAA:
-			in6_addr in6;
-			if (inet_pton(AF_INET6, field, &in6) != 1)
+				auto it = view_ids.find(key);
+				if (it != view_ids.end()) {
+					view = it->second;
+					continue;
+				}
+				if (views.size() > zone::max_view) {
+					errno = 0;
+					return build_error("read_zone: more than " + to_string(zone::max_view) + " views");
+				}
+				view = views.size();
+				view_ids[key] = view;
+				views.push_back(view_matches());
+				views.back().nets = move(nets);
 				continue;
-			rlen = htons(sizeof(in6));
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, &in6, sizeof(in6));
-			rr_ptr += sizeof(in6);
-			if (dltype == htons(dns_type::SOA))
-				m->rr = string(rr, rr_ptr - rr) + m->rr;
-			else
-				m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
+			}
 
-		case dns_type::NS:
-			if (host2qname(field, dname) <= 0)
-				continue;
-			if (dname.size() > 255)
+			if (l.link) {
+				link = l.ok ? &l : nullptr;
 				continue;
-			rlen = htons(dname.size());
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			if (dltype == htons(dns_type::SOA))
-				m->rr = string(rr, rr_ptr - rr) + m->rr;
-			else
-				m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
+			}
 
-		case dns_type::CNAME:
-			m->type = dtype;
-			if (host2qname(field, dname) <= 0)
-				continue;
-			if (dname.size() > 255)
-				continue;
-			rlen = htons(dname.size());
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			if (dltype == htons(dns_type::SOA))
-				m->rr = string(rr, rr_ptr - rr) + m->rr;
-			else
-				m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
+			const zone_line *to = link;
+			link = nullptr;
 
-		// Once a SOA has been linked in, no other RR's must be linked,
-		// as they must appear between answer and additional section
-		case dns_type::SOA:
-			m->type = dtype;
-			if (host2qname(field, dname) <= 0)
-				continue;
-			if (dname.size() > 255)
+			if (!l.ok)
 				continue;
-			rlen = htons(2*dname.size() + sizeof(soa_ints));
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			memcpy(rr_ptr, soa_ints, sizeof(soa_ints));
-			rr_ptr += sizeof(soa_ints);
-			m->rr += string(rr, rr_ptr - rr);
-			m->rra_count = htons(1);
-			break;
-		case dns_type::SRV:
-			m->type = dtype;
 
-			// avoid warning about unaligned &src.port access
-			if (sscanf(field, "%255[^:]:%hu:%hu:%hu", name, &prio, &weight, &prt) != 4)
-				continue;
-			srv.port = prt;
+			match nm, *m = nullptr;
 
-			if (host2qname(name, dname) <= 0)
-				continue;
-			if (dname.size() > 255)
-				continue;
-			srv.len = htons(dname.size() + 6);
-			srv.type = dtype;
-			srv._class = dclass;
-			srv.ttl = ttl;
-			srv.prio = htons(prio);
-			srv.weight = htons(weight);
-			srv.port = htons(srv.port);
-			memcpy(rr_ptr, &srv, sizeof(srv));
-			rr_ptr += sizeof(srv);
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
-		case dns_type::TXT:
-		case dns_type::PTR:
-			m->type = dtype;
-			if (sscanf(field, "%255[^\n]", name) != 1)
-				continue;
-			if (host2qname(name, dname) <= 0)
-				continue;
-			if (dname.size() > 255)
-				continue;
-			rlen = htons(dname.size());
-			memcpy(rr_ptr, &dtype, sizeof(dtype));
-			rr_ptr += sizeof(dtype);
-			memcpy(rr_ptr, &dclass, sizeof(dclass));
-			rr_ptr += sizeof(dclass);
-			memcpy(rr_ptr, &ttl, sizeof(ttl));
-			rr_ptr += sizeof(ttl);
-			memcpy(rr_ptr, &rlen, sizeof(rlen));
-			rr_ptr += sizeof(rlen);
-			memcpy(rr_ptr, dname.c_str(), dname.size());
-			rr_ptr += dname.size();
-			m->rr += string(rr, rr_ptr - rr);
-			m->a_count += htons(1);
-			break;
-		default:
-			if (link_rr.size() == 0)
-				delete m;
-			continue;
-		}
+			if (to) {
+				if (to->name.empty())
+					continue;
+				match_map &exact_matches = views[view].exact, &wild_matches = views[view].wild;
+				auto it = exact_matches.find(make_pair(to->name, to->type));
+				if (it == exact_matches.end() && (it = wild_matches.find(make_pair(to->name, to->type))) == wild_matches.end())
+					continue;
+				m = &matches[it->second.back()];
+
+				// Can't use compression here, since its maybe an unrelated name.
+				l.rr.insert(0, l.name);
+			} else {
+				if (l.owner.empty())
+					continue;
+				m = &nm;
+				m->fqdn = move(l.fqdn);
+				m->field = move(l.field);
+				m->ttl = l.ttl;
+				m->type = l.type;
+				m->mtype = l.wild ? QDNS_MATCH_WILD : QDNS_MATCH_EXACT;
+				l.rr.insert(0, compressed);
+			}
+
+			// If we are linking against a SOA, reverse order since
+			// Authority comes after answer section. Once a SOA has been
+			// linked in, no other RRs must be linked, as they must
+			// appear between answer and additional section.
+			uint16_t t = ntohs(l.type);
+			if (to && to->type == htons(dns_type::SOA) &&
+			    (t == dns_type::A || t == dns_type::MX || t == dns_type::AAAA || t == dns_type::NS || t == dns_type::CNAME))
+				m->rr.insert(0, l.rr);
+			else if (m->rr.empty())
+				m->rr = move(l.rr);
+			else
+				m->rr += l.rr;
 
-		// Only add new match if not linked to existing one
-		if (link_rr.size() == 0) {
-			if (m->mtype == QDNS_MATCH_EXACT)
-				exact_matches[make_pair(m->name, m->type)].push_back(m);
+			if (t == dns_type::SOA)
+				m->rra_count = htons(1);
 			else
-				wild_matches[make_pair(m->name, m->type)].push_back(m);
-		}
+				m->a_count += htons(1);
+
+			// Only add new match if not linked to existing one
+			if (!to) {
+				match_map &mm = l.wild ? views[view].wild : views[view].exact;
+				mm[make_pair(move(l.owner), l.type)].push_back(matches.size());
+				matches.push_back(move(nm));
+			}
 
-		++records;
+			++records;
+		}
 	}
-	fclose(f);
+
+	if (compile_zone(matches, views, result) < 0)
+		return -1;
+
 	cout<<"Successfully loaded "<<records<<" Quantum-RR's.\n";
 	return 0;
 }
@@ -21,9 +21,15 @@
 #define qdns_qdns_h
 
 #include <map>
-#include <list>
+#include <atomic>
 #include <string>
+#include <vector>
 #include "provider.h"
+#include "zone.h"
+#include "once.h"
+#include "rrl.h"
+#include "logger.h"
+#include "stats.h"
 
 
 namespace qdns {
@@ -32,58 +38,129 @@ class qdns {
 
 	std::string err;
 
-	struct {
-		std::string pkt;
-		std::string question;
-		std::string reply;
-	} client;
-
 	typedef enum {
 		QDNS_MATCH_INVALID	= 0,
 		QDNS_MATCH_EXACT	= 0x1000,
 		QDNS_MATCH_WILD		= 0x2000
 	} match_type;
 
+	// the owner name is the key of the match_map it is in
 	struct match {
-		std::string fqdn, name, question, field;
+		std::string fqdn, field;
 
 		// in network order:
-		uint16_t type, _class;
+		uint16_t type;
 		uint16_t a_count, rra_count, ad_count;
 		uint32_t ttl;
 		std::string rr;
 		match_type mtype;
 
-		match() : fqdn(""), name(""), question(""), field(""),
-		          type(0), _class(0), a_count(0), rra_count(0), ad_count(0),
+		match() : fqdn(""), field(""), type(0), a_count(0), rra_count(0), ad_count(0),
 		          ttl(0), rr(""), mtype(QDNS_MATCH_INVALID)
 		{}
 	};
 
+	// (qname, qtype) -> indexes of matches; only used while parsing the zone file
+	typedef std::map<std::pair<std::string, uint16_t>, std::vector<uint32_t>> match_map;
+
+	// a network of a view's clients, the address in network order
+	struct client_net {
+		int family;
+		unsigned len;
+		uint8_t addr[16];
+	};
+
+	// the records of a view and the networks it is for; view 0 has
+	// the records for everyone and no networks
+	struct view_matches {
+		match_map exact, wild;
+		std::vector<client_net> nets;
+	};
+
+	// The zone being served, read-only and shared by all workers without
+	// locking. reload() builds a new one aside and swaps it in; workers
+	// pick it up with their next batch, and the old one is deleted once
+	// no worker is inside a batch that started before the swap.
+	std::atomic<zone *> z;
+	std::atomic<uint64_t> zgen;
+	std::string zfile;
+
+	// everything a serving thread writes to lives here, one per thread
+	struct worker {
+
+		// the zone of the current batch, and what rr_pos, once and rrl are for
+		zone *z;
+		std::vector<uint32_t> rr_pos;
+		once_set once;
+
+		// response rate limits of what this worker sends
+		rrl_table rrl;
+
+		// seconds, taken once per batch
+		uint32_t now;
+
+		// zgen when the current batch started, 0 between batches
+		std::atomic<uint64_t> epoch;
+
+		size_t id;	// also the log ring
+		dns_provider *io;
+
+		std::vector<dns_msg> msgs;
+
+		worker_stats st;
+
+		worker() : z(nullptr), now(0), epoch(0), id(0), io(nullptr)
+		{}
+
+		~worker()
+		{
+			delete io;
+		}
+	};
+
+	std::vector<worker *> workers;
+
+	logger log;
+
+	stats_server stats;
+
 	bool nxdomain, resend;
 
-	dns_provider *io{nullptr};
+	// how many packets to receive and answer per provider call
+	size_t batch;
 
-	// (qname, qtype) -> match
-	std::map<std::pair<std::string, uint16_t>, std::list<match *>> exact_matches, wild_matches;
-	std::map<std::string, int> once;
+	// the microbenchmarks run parse_packet() on a worker of their own
+	friend struct bench_access;
 
-	std::string src;
+	// "make check" looks names up in the zone
+	friend struct test_access;
 
 
 protected:
 
 	int build_error(const std::string &);
 
+	int compile_zone(const std::vector<match> &, const std::vector<view_matches> &, zone *&);
+
+	int read_zone(const std::string &, zone *&);
+
+	int loop(worker *);
+
 public:
 
-	qdns() : err(""), client{"", "", ""}, nxdomain(1), resend(0), src("")
+	qdns() : err(""), z(nullptr), zgen(1), zfile(""), nxdomain(1), resend(0), batch(32)
 	{
 	}
 
 	virtual ~qdns()
 	{
-		delete io;
+		// the records refer to the workers' providers, the stats
+		// to the workers
+		stats.shutdown();
+		log.shutdown();
+		for (auto w : workers)
+			delete w;
+		delete z.load();
 	}
 
 	const char *why()
@@ -93,10 +170,15 @@ public:
 
 	int init(const std::map<std::string, std::string> &);
 
-	int parse_packet(const std::string &, std::string &, std::string &);
+	int parse_packet(worker *, dns_msg &, query_log &);
 
 	int parse_zone(const std::string &);
 
+	int save_zone(const std::string &);
+
+	// parse the zone file again and serve it; done on SIGHUP
+	int reload();
+
 	int loop();
 
 };
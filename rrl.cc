@@ -0,0 +1,157 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <netinet/in.h>
+#include "rrl.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+int rrl_table::init(size_t capacity, uint32_t r, uint32_t nxr, uint32_t w, uint32_t s,
+                    unsigned p4, unsigned p6)
+{
+	size_t n = 1;
+	while (n*ways < capacity)
+		n <<= 1;
+
+	// the sets start on a cache line, and are one
+	static_assert(sizeof(set) == 64, "rrl set size");
+	try {
+		mem.assign(n*sizeof(set) + 64, 0);
+	} catch (...) {
+		return -1;
+	}
+	uintptr_t p = reinterpret_cast<uintptr_t>(&mem[0]);
+	sets = reinterpret_cast<set *>((p + 63) & ~uintptr_t(63));
+	mask = n - 1;
+
+	window = w > 0 ? (w < max_window ? w : max_window) : 1;
+	slip = s < max_slip ? s : max_slip;
+
+	// a bucket's balance goes from rate down to -window*rate
+	uint32_t max_rate = numeric_limits<int32_t>::max()/window;
+	rate[QDNS_RRL_ANSWER] = r < max_rate ? r : max_rate;
+	rate[QDNS_RRL_WILDCARD] = rate[QDNS_RRL_ANSWER];
+	rate[QDNS_RRL_NXDOMAIN] = nxr < max_rate ? nxr : max_rate;
+
+	// the prefixes as masks in network order
+	uint8_t m[16];
+	memset(m, 0, sizeof(m));
+	for (unsigned i = 0; i < p4 && i < 32; ++i)
+		m[i/8] |= 0x80>>(i % 8);
+	memcpy(&mask4, m, sizeof(mask4));
+	memset(m, 0, sizeof(m));
+	for (unsigned i = 0; i < p6 && i < 128; ++i)
+		m[i/8] |= 0x80>>(i % 8);
+	memcpy(mask6, m, sizeof(mask6));
+	return 0;
+}
+
+
+void rrl_table::clear()
+{
+	if (sets)
+		memset(sets, 0, (mask + 1)*sizeof(set));
+}
+
+
+// the peer's network and the class, mixed into the 56 bits of a key
+uint64_t rrl_table::key(const sockaddr_storage &peer, rrl_class c) const
+{
+	uint64_t w[2] = {0, 0}, h = uint64_t(c)<<1;
+
+	if (peer.ss_family == AF_INET) {
+		uint32_t a = reinterpret_cast<const sockaddr_in *>(&peer)->sin_addr.s_addr;
+		w[0] = a & mask4;
+	} else {
+		memcpy(w, &reinterpret_cast<const sockaddr_in6 *>(&peer)->sin6_addr, sizeof(w));
+		w[0] &= mask6[0];
+		w[1] &= mask6[1];
+		h |= 1;
+	}
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < 2; ++i) {
+		h = (h ^ w[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h>>32;
+	}
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h>>29;
+	h &= (1ULL<<56) - 1;
+
+	return h ? h : 1;
+}
+
+
+rrl_verdict rrl_table::check(const sockaddr_storage &peer, rrl_class c, uint32_t now)
+{
+	int64_t r = rate[c];
+
+	if (!sets || r == 0)
+		return QDNS_RRL_PASS;
+
+	uint64_t k = key(peer, c);
+	set &s = sets[(k>>32 ^ k) & mask];
+
+	bucket *b = nullptr, *victim = &s.b[0];
+	for (int i = 0; i < ways; ++i) {
+		if (s.b[i].key == k) {
+			b = &s.b[i];
+			break;
+		}
+		if (s.b[i].key == 0 || now - s.b[i].last > now - victim->last)
+			victim = &s.b[i];
+	}
+
+	if (!b) {
+		b = victim;
+		b->key = k;
+		b->slips = 0;
+		b->last = now;
+		b->balance = r;
+	} else if (now != b->last) {
+		int64_t bal = b->balance + int64_t(now - b->last)*r;
+		b->balance = bal < r ? bal : r;
+		b->last = now;
+	}
+
+	if (b->balance > 0) {
+		--b->balance;
+		return QDNS_RRL_PASS;
+	}
+
+	if (b->balance > -int64_t(window)*r)
+		--b->balance;
+
+	if (slip > 0 && ++b->slips >= slip) {
+		b->slips = 0;
+		return QDNS_RRL_SLIP;
+	}
+	return QDNS_RRL_DROP;
+}
+
+
+} // namespace
@@ -0,0 +1,121 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef qdns_rrl_h
+#define qdns_rrl_h
+
+#include <vector>
+#include <cstdint>
+#include <sys/socket.h>
+
+
+namespace qdns {
+
+
+typedef enum {
+	QDNS_RRL_ANSWER		= 0,
+	QDNS_RRL_NXDOMAIN,
+	QDNS_RRL_WILDCARD,
+	QDNS_RRL_CLASSES
+} rrl_class;
+
+
+typedef enum {
+	QDNS_RRL_PASS		= 0,
+	QDNS_RRL_DROP,
+	QDNS_RRL_SLIP		// send a truncated reply instead
+} rrl_verdict;
+
+
+// Response rate limiting in the way of BIND's RRL. Every client network
+// (the address masked to a prefix) has a token bucket per class of
+// response it gets: answers, wildcard answers and NXDOMAIN. A bucket is
+// refilled by rate tokens per second, up to rate; each response takes
+// one. An empty bucket goes into debt down to window seconds worth of
+// tokens, so a flood keeps being limited until it has stopped for a
+// while. Of the limited responses of a bucket, every slip'th is sent
+// truncated, so that real clients behind a spoofed prefix can retry
+// over TCP.
+//
+// The buckets live in a fixed table of cache line sized sets of four,
+// keyed by a 64 bit hash; a new bucket takes the place of the one in
+// its set that was used longest ago.
+class rrl_table {
+
+	struct bucket {
+		uint64_t key : 56;	// 0: unused
+		uint64_t slips : 8;	// limited responses since the last truncated one
+		uint32_t last;		// seconds
+		int32_t balance;	// init() keeps window*rate within 31 bits
+	};
+
+	enum {
+		ways = 4
+	};
+
+	enum : uint32_t {
+		max_window = 3600,
+		max_slip = 255
+	};
+
+	struct set {
+		bucket b[ways];
+	};
+
+	std::vector<char> mem;
+	set *sets;
+	size_t mask;
+
+	uint32_t rate[QDNS_RRL_CLASSES];
+	uint32_t window, slip;
+	uint32_t mask4;
+	uint64_t mask6[2];
+
+	uint64_t key(const sockaddr_storage &, rrl_class) const;
+
+public:
+
+	rrl_table() : sets(nullptr), mask(0), window(15), slip(2), mask4(0)
+	{
+		mask6[0] = mask6[1] = 0;
+		for (auto &r : rate)
+			r = 0;
+	}
+
+	// room for about capacity buckets; rate and nxrate are responses
+	// per second, 0 means unlimited. window is cut to an hour, slip to
+	// 255, and the rates to what a window's debt of them can count.
+	int init(size_t capacity, uint32_t rate, uint32_t nxrate, uint32_t window, uint32_t slip,
+	         unsigned prefix4, unsigned prefix6);
+
+	bool enabled() const
+	{
+		return sets != nullptr;
+	}
+
+	void clear();
+
+	// whether a response of class c to peer goes out; now is in seconds
+	rrl_verdict check(const sockaddr_storage &peer, rrl_class c, uint32_t now);
+};
+
+
+} // namespace
+
+#endif
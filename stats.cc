@@ -0,0 +1,269 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "stats.h"
+#include "net-headers.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+static const char *counter_names[QDNS_STAT_MAX] = {
+	"queries",
+	"invalid",
+	"hits_exact",
+	"hits_wild",
+	"hits_forward",
+	"nxdomain",
+	"nxdomain_nosend",
+	"nxdomain_nofwd",
+	"resend",
+	"once_suppressed",
+	"too_big",
+	"truncated",
+	"rrl_dropped",
+	"rrl_slipped",
+	"edns",
+	"edns_badvers",
+	"replies",
+	"send_errors",
+	"bytes_in",
+	"bytes_out"
+};
+
+
+static const char *qtype_name(unsigned t)
+{
+	using net_headers::dns_type;
+
+	switch (t) {
+	case dns_type::A:
+		return "A";
+	case dns_type::NS:
+		return "NS";
+	case dns_type::CNAME:
+		return "CNAME";
+	case dns_type::SOA:
+		return "SOA";
+	case dns_type::PTR:
+		return "PTR";
+	case dns_type::MX:
+		return "MX";
+	case dns_type::TXT:
+		return "TXT";
+	case dns_type::AAAA:
+		return "AAAA";
+	case dns_type::SRV:
+		return "SRV";
+	}
+	return nullptr;
+}
+
+
+int stats_server::build_error(const string &s)
+{
+	err = "stats_server::";
+	err += s;
+	if (errno) {
+		err += ": ";
+		err += strerror(errno);
+	}
+	return -1;
+}
+
+
+stats_server::~stats_server()
+{
+	shutdown();
+}
+
+
+void stats_server::shutdown()
+{
+	if (sock < 0)
+		return;
+
+	// wakes up the accept() of serve()
+	::shutdown(sock, SHUT_RDWR);
+	if (th.joinable())
+		th.join();
+	close(sock);
+	sock = -1;
+	unlink(path.c_str());
+}
+
+
+int stats_server::init(const string &p, const vector<const worker_stats *> &w)
+{
+	sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	if (p.size() >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return build_error("init: " + p);
+	}
+	memcpy(sun.sun_path, p.c_str(), p.size());
+
+	try {
+		workers = w;
+	} catch (...) {
+		return build_error("init: OOM");
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return build_error("init: socket");
+
+	// a socket left behind by an earlier run
+	unlink(p.c_str());
+	if (::bind(sock, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0)
+		return build_error("init: bind " + p);
+	path = p;
+	if (listen(sock, 16) < 0)
+		return build_error("init: listen");
+
+	return 0;
+}
+
+
+int stats_server::start()
+{
+	if (sock < 0)
+		return 0;
+
+	try {
+		th = thread([this]{ serve(); });
+	} catch (...) {
+		return build_error("start: failed to start stats thread");
+	}
+	return 0;
+}
+
+
+// one report per connection, then it is closed
+void stats_server::serve()
+{
+	for (;;) {
+		int peer = accept(sock, nullptr, nullptr);
+		if (peer < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		string report = "";
+		try {
+			report = format(workers);
+		} catch (...) {
+		}
+
+		for (size_t off = 0; off < report.size();) {
+			ssize_t r = write(peer, report.c_str() + off, report.size() - off);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+			off += r;
+		}
+		close(peer);
+	}
+}
+
+
+// "name value" lines: the counters summed over all workers, the
+// queries of each worker, by qtype, and the receive to send latency
+// of replies as a cumulative histogram
+string stats_server::format(const vector<const worker_stats *> &workers)
+{
+	string out = "";
+	char line[128];
+	uint64_t sum = 0;
+
+	for (int i = 0; i < QDNS_STAT_MAX; ++i) {
+		sum = 0;
+		for (auto w : workers)
+			sum += w->c[i].load(memory_order_relaxed);
+		snprintf(line, sizeof(line), "%s %llu\n", counter_names[i], (unsigned long long)sum);
+		out += line;
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		snprintf(line, sizeof(line), "worker%zu_queries %llu\n", i,
+		         (unsigned long long)workers[i]->c[QDNS_STAT_QUERIES].load(memory_order_relaxed));
+		out += line;
+	}
+
+	for (unsigned t = 0; t <= worker_stats::qtypes; ++t) {
+		sum = 0;
+		for (auto w : workers)
+			sum += w->qtype[t].load(memory_order_relaxed);
+		if (sum == 0)
+			continue;
+
+		const char *name = qtype_name(t);
+		if (t == worker_stats::qtypes)
+			snprintf(line, sizeof(line), "qtype_other %llu\n", (unsigned long long)sum);
+		else if (name)
+			snprintf(line, sizeof(line), "qtype_%s %llu\n", name, (unsigned long long)sum);
+		else
+			snprintf(line, sizeof(line), "qtype_%u %llu\n", t, (unsigned long long)sum);
+		out += line;
+	}
+
+	// only the buckets from the first to the last one in use
+	uint64_t buckets[worker_stats::lat_buckets];
+	int first = -1, last = -1;
+	for (int b = 0; b < worker_stats::lat_buckets; ++b) {
+		buckets[b] = 0;
+		for (auto w : workers)
+			buckets[b] += w->latency[b].load(memory_order_relaxed);
+		if (buckets[b] && first < 0)
+			first = b;
+		if (buckets[b])
+			last = b;
+	}
+
+	sum = 0;
+	for (int b = first < 0 ? 0 : first; b <= last; ++b) {
+		sum += buckets[b];
+		if (b == worker_stats::lat_buckets - 1)
+			snprintf(line, sizeof(line), "latency_ns_le_inf %llu\n", (unsigned long long)sum);
+		else
+			snprintf(line, sizeof(line), "latency_ns_le_%llu %llu\n", 1ULL<<b, (unsigned long long)sum);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "latency_count %llu\n", (unsigned long long)sum);
+	out += line;
+
+	return out;
+}
+
+
+} // namespace
@@ -0,0 +1,204 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef qdns_stats_h
+#define qdns_stats_h
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "provider.h"
+#include "logger.h"
+
+
+namespace qdns {
+
+
+typedef enum {
+	QDNS_STAT_QUERIES	= 0,
+	QDNS_STAT_INVALID,		// could not be parsed
+	QDNS_STAT_EXACT,		// hits
+	QDNS_STAT_WILD,
+	QDNS_STAT_FORWARD,		// NXDOMAIN answered from [forward]
+	QDNS_STAT_NXDOMAIN,		// all NXDOMAIN, answered or not
+	QDNS_STAT_NOSEND,		// NXDOMAIN not answered (-X)
+	QDNS_STAT_NOFWD,		// NXDOMAIN without [forward]
+	QDNS_STAT_RESEND,
+	QDNS_STAT_ONCE,			// TTL=1 RR suppressed
+	QDNS_STAT_TOOBIG,
+	QDNS_STAT_TRUNCATED,		// sent with TC, to retry over TCP
+	QDNS_STAT_RRL_DROP,		// rate limited
+	QDNS_STAT_RRL_SLIP,		// rate limited, sent with TC
+	QDNS_STAT_EDNS,			// queries with an OPT RR
+	QDNS_STAT_BADVERS,		// of which not EDNS version 0
+	QDNS_STAT_REPLIES,
+	QDNS_STAT_SEND_ERRORS,		// failed reply()/resend() calls
+	QDNS_STAT_BYTES_IN,
+	QDNS_STAT_BYTES_OUT,
+	QDNS_STAT_MAX
+} stat_counter;
+
+
+// The counters of one worker. Only that worker writes them, so they are
+// bumped with a relaxed load and store rather than a locked instruction,
+// and the stats thread reads them whenever it is asked. The padding keeps
+// other workers' counters off these cache lines.
+struct worker_stats {
+
+	enum {
+		qtypes = 256,		// counted by qtype, the rest as "other"
+		lat_buckets = 32	// bucket i: up to 2^i ns
+	};
+
+	typedef std::atomic<uint64_t> counter;
+
+	char pad0[64];
+	counter c[QDNS_STAT_MAX];
+	counter qtype[qtypes + 1];
+	counter latency[lat_buckets];
+	char pad1[64];
+
+	worker_stats()
+	{
+		for (auto &x : c)
+			x.store(0, std::memory_order_relaxed);
+		for (auto &x : qtype)
+			x.store(0, std::memory_order_relaxed);
+		for (auto &x : latency)
+			x.store(0, std::memory_order_relaxed);
+	}
+
+	static void add(counter &x, uint64_t v)
+	{
+		x.store(x.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+	}
+
+	void add(stat_counter i, uint64_t v = 1)
+	{
+		add(c[i], v);
+	}
+
+	// what parse_packet() did with the query in msg
+	void count(const dns_msg &msg, const query_log &ql)
+	{
+		add(QDNS_STAT_QUERIES);
+		add(QDNS_STAT_BYTES_IN, msg.qlen);
+		if (msg.action == QDNS_MSG_REPLY) {
+			add(QDNS_STAT_REPLIES);
+			add(QDNS_STAT_BYTES_OUT, msg.rlen);
+		}
+
+		if (ql.flags & QDNS_LOG_INVALID) {
+			add(QDNS_STAT_INVALID);
+			return;
+		}
+		add(qtype[ql.qtype < qtypes ? ql.qtype : qtypes], 1);
+
+		if (ql.flags & QDNS_LOG_EDNS)
+			add(QDNS_STAT_EDNS);
+		if (ql.flags & QDNS_LOG_BADVERS) {
+			add(QDNS_STAT_BADVERS);
+			return;
+		}
+
+		if (ql.flags & QDNS_LOG_NXDOMAIN) {
+			add(QDNS_STAT_NXDOMAIN);
+			if (ql.flags & QDNS_LOG_RESEND)
+				add(QDNS_STAT_RESEND);
+			else if (ql.flags & QDNS_LOG_NOSEND)
+				add(QDNS_STAT_NOSEND);
+			else if (ql.flags & QDNS_LOG_NOFWD)
+				add(QDNS_STAT_NOFWD);
+			else
+				add(QDNS_STAT_FORWARD);
+		} else if (ql.flags & QDNS_LOG_WILD)
+			add(QDNS_STAT_WILD);
+		else
+			add(QDNS_STAT_EXACT);
+
+		if (ql.flags & QDNS_LOG_ONCE)
+			add(QDNS_STAT_ONCE);
+		if (ql.flags & QDNS_LOG_TOOBIG)
+			add(QDNS_STAT_TOOBIG);
+		if (ql.flags & QDNS_LOG_TC)
+			add(QDNS_STAT_TRUNCATED);
+		if (ql.flags & QDNS_LOG_RRL_DROP)
+			add(QDNS_STAT_RRL_DROP);
+		if (ql.flags & QDNS_LOG_RRL_SLIP)
+			add(QDNS_STAT_RRL_SLIP);
+	}
+
+	// n replies that took ns from receive to send
+	void latency_ns(uint64_t ns, uint64_t n)
+	{
+		size_t b = 0;
+		while (b < lat_buckets - 1 && (1ULL<<b) < ns)
+			++b;
+		add(latency[b], n);
+	}
+};
+
+
+// Serves the sum of all workers' counters as text to whoever connects
+// to a Unix socket, from a thread of its own.
+class stats_server {
+
+	int sock;
+	std::string path;
+	std::vector<const worker_stats *> workers;
+
+	std::thread th;
+
+	std::string err;
+
+	void serve();
+
+	int build_error(const std::string &);
+
+public:
+
+	stats_server() : sock(-1), path(""), err("")
+	{
+	}
+
+	virtual ~stats_server();
+
+	const char *why()
+	{
+		return err.c_str();
+	}
+
+	// listen on the Unix socket at path
+	int init(const std::string &path, const std::vector<const worker_stats *> &);
+
+	int start();
+
+	// stop serving and remove the socket
+	void shutdown();
+
+	// the report as it is sent
+	static std::string format(const std::vector<const worker_stats *> &);
+};
+
+
+} // namespace
+
+#endif
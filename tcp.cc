@@ -0,0 +1,503 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "provider.h"
+
+#ifdef QDNS_HAVE_EPOLL
+
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+using namespace std;
+
+namespace qdns {
+
+
+// epoll data of the listening socket; connections use their slot
+const uint64_t listen_id = ~0ULL;
+
+// a message and its length prefix
+const size_t tcp_max_frame = 2 + 65535;
+
+// how much of its replies a peer may leave unread before it is dropped
+const size_t tcp_max_out = 4*tcp_max_frame;
+
+
+int tcp_provider::build_error(const string &s)
+{
+	err = "tcp_provider::";
+	err += s;
+	if (errno) {
+		err += ": ";
+		err += strerror(errno);
+	}
+	return -1;
+}
+
+
+tcp_provider::~tcp_provider()
+{
+	for (auto &c : conns) {
+		if (c.fd >= 0)
+			close(c.fd);
+	}
+	if (ep >= 0)
+		close(ep);
+	if (lsock >= 0)
+		close(lsock);
+	delete [] events;
+}
+
+
+int tcp_provider::init(const map<string, string> &args)
+{
+	auto it = args.find("laddr");
+
+	if (it != args.end())
+		laddr = it->second;
+	if ((it = args.find("lport")) != args.end())
+		lport = it->second;
+
+	size_t batch = 1;
+	if ((it = args.find("batch")) != args.end())
+		batch = strtoul(it->second.c_str(), NULL, 10);
+	if (batch == 0)
+		batch = 1;
+	if ((it = args.find("tcp_max")) != args.end())
+		max_conns = strtoul(it->second.c_str(), NULL, 10);
+	if (max_conns == 0)
+		max_conns = 1;
+	if ((it = args.find("tcp_idle")) != args.end())
+		idle = strtoul(it->second.c_str(), NULL, 10);
+
+	addrinfo hints, *ai = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(laddr.c_str(), lport.c_str(), &hints, &ai) != 0)
+		return build_error("init: failed to resolve 'laddr'");
+
+	if ((lsock = socket(ai->ai_family, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
+		freeaddrinfo(ai);
+		return build_error("init: socket");
+	}
+
+	int one = 1;
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	int r = ::bind(lsock, ai->ai_addr, ai->ai_addrlen);
+	freeaddrinfo(ai);
+	if (r < 0)
+		return build_error("init: bind");
+	if (listen(lsock, 128) < 0)
+		return build_error("init: listen");
+
+	if ((ep = epoll_create1(0)) < 0)
+		return build_error("init: epoll_create1");
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = listen_id;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, lsock, &ev) < 0)
+		return build_error("init: epoll_ctl");
+
+	nevents = 64;
+	if (!(events = new (nothrow) epoll_event[nevents]))
+		return build_error("init: OOM");
+
+	try {
+		conns.resize(max_conns);
+		free_slots.reserve(max_conns);
+		for (size_t i = max_conns; i > 0; --i)
+			free_slots.push_back(i - 1);
+		ready.reserve(max_conns);
+		of.resize(batch);
+	} catch (...) {
+		return build_error("init: OOM");
+	}
+
+	return 0;
+}
+
+
+void tcp_provider::accept_all()
+{
+	for (;;) {
+		sockaddr_storage peer;
+		socklen_t plen = sizeof(peer);
+
+		int fd = accept4(lsock, reinterpret_cast<sockaddr *>(&peer), &plen, SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// no more connections than max_conns
+		if (free_slots.empty()) {
+			close(fd);
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		size_t i = free_slots.back();
+		conn &c = conns[i];
+
+		try {
+			if (c.in.size() == 0)
+				c.in.resize(2 + dns_max_query);
+		} catch (...) {
+			close(fd);
+			continue;
+		}
+
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = i;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+
+		free_slots.pop_back();
+		c.fd = fd;
+		c.events = EPOLLIN;
+		memcpy(&c.peer, &peer, sizeof(peer));
+		c.plen = plen;
+		c.in_len = c.in_off = 0;
+		c.out.clear();
+		c.last = now;
+		c.eof = c.ready = 0;
+	}
+}
+
+
+void tcp_provider::close_conn(size_t i)
+{
+	conn &c = conns[i];
+
+	if (c.fd < 0)
+		return;
+
+	epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, nullptr);
+	close(c.fd);
+	c.fd = -1;
+	c.events = 0;
+	c.in_len = c.in_off = 0;
+	c.out.clear();
+
+	if (c.ready) {
+		for (size_t r = 0; r < ready.size(); ++r) {
+			if (ready[r] == i) {
+				ready.erase(ready.begin() + r);
+				break;
+			}
+		}
+		c.ready = 0;
+	}
+
+	free_slots.push_back(i);
+}
+
+
+// watch for input until the peer is done sending, and for room to
+// write as long as replies are queued
+void tcp_provider::watch(size_t i)
+{
+	conn &c = conns[i];
+	uint32_t want = (c.eof ? 0 : EPOLLIN) | (c.out.empty() ? 0 : EPOLLOUT);
+
+	if (want == c.events)
+		return;
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want;
+	ev.data.u64 = i;
+	if (epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev) == 0)
+		c.events = want;
+}
+
+
+bool tcp_provider::has_query(const conn &c) const
+{
+	size_t avail = c.in_len - c.in_off;
+
+	if (avail < 2)
+		return 0;
+
+	size_t len = (static_cast<uint8_t>(c.in[c.in_off])<<8) | static_cast<uint8_t>(c.in[c.in_off + 1]);
+	return avail >= 2 + len;
+}
+
+
+int tcp_provider::flush(conn &c)
+{
+	while (!c.out.empty()) {
+		ssize_t r = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		c.out.erase(0, r);
+	}
+	return 0;
+}
+
+
+// Read what is there, after moving the queries that were handed out
+// before out of the way. The buffer grows to the largest query this
+// peer announces.
+void tcp_provider::read_some(size_t i)
+{
+	conn &c = conns[i];
+
+	if (c.in_off > 0) {
+		memmove(&c.in[0], &c.in[c.in_off], c.in_len - c.in_off);
+		c.in_len -= c.in_off;
+		c.in_off = 0;
+	}
+
+	if (c.in_len >= 2) {
+		size_t need = 2 + ((static_cast<uint8_t>(c.in[0])<<8) | static_cast<uint8_t>(c.in[1]));
+		if (need > c.in.size()) {
+			try {
+				c.in.resize(need);
+			} catch (...) {
+				close_conn(i);
+				return;
+			}
+		}
+	}
+
+	if (c.in_len < c.in.size()) {
+		ssize_t r = ::recv(c.fd, &c.in[c.in_len], c.in.size() - c.in_len, 0);
+		if (r > 0) {
+			c.in_len += r;
+			c.last = now;
+		} else if (r == 0) {
+			c.eof = 1;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			close_conn(i);
+			return;
+		}
+	}
+
+	bool q = has_query(c);
+
+	if (q && !c.ready) {
+		ready.push_back(i);
+		c.ready = 1;
+	}
+
+	if (c.eof) {
+		if (!q && c.out.empty())
+			close_conn(i);
+		else
+			watch(i);
+	}
+}
+
+
+int tcp_provider::recv(vector<dns_msg> &msgs)
+{
+	now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+
+	// the last batch is answered, so peers that have sent their last
+	// query and got all replies are done
+	for (size_t k = 0; k < nof; ++k) {
+		conn &c = conns[of[k]];
+		if (c.fd >= 0 && c.eof && c.out.empty() && !has_query(c))
+			close_conn(of[k]);
+	}
+	nof = 0;
+
+	if (now != last_sweep) {
+		for (size_t i = 0; i < conns.size(); ++i) {
+			if (conns[i].fd >= 0 && now - conns[i].last >= idle)
+				close_conn(i);
+		}
+		last_sweep = now;
+	}
+
+	// wake up once a second for the idle connections, unless there
+	// are queries left over from the last call
+	int n = epoll_wait(ep, events, nevents, ready.empty() ? 1000 : 0);
+	if (n < 0) {
+		if (errno != EINTR)
+			return build_error("recv: epoll_wait");
+		n = 0;
+	}
+
+	for (int e = 0; e < n; ++e) {
+		if (events[e].data.u64 == listen_id) {
+			accept_all();
+			continue;
+		}
+
+		size_t i = events[e].data.u64;
+		conn &c = conns[i];
+		if (c.fd < 0)
+			continue;
+
+		if (events[e].events & EPOLLOUT) {
+			if (flush(c) < 0) {
+				close_conn(i);
+				continue;
+			}
+			if (c.eof && c.out.empty() && !has_query(c)) {
+				close_conn(i);
+				continue;
+			}
+			watch(i);
+		}
+		if (events[e].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			read_some(i);
+	}
+
+	// all complete queries of each ready connection, as long as there
+	// is room in the batch; the rest are handed out next time
+	size_t k = 0, kept = 0;
+	for (size_t r = 0; r < ready.size(); ++r) {
+		size_t i = ready[r];
+		conn &c = conns[i];
+
+		while (k < msgs.size() && k < of.size() && has_query(c)) {
+			size_t len = (static_cast<uint8_t>(c.in[c.in_off])<<8) | static_cast<uint8_t>(c.in[c.in_off + 1]);
+			dns_msg &msg = msgs[k];
+
+			msg.qbuf = &c.in[c.in_off + 2];
+			msg.qlen = len;
+			msg.rlen = 0;
+			memcpy(&msg.peer, &c.peer, sizeof(c.peer));
+			msg.plen = c.plen;
+			msg.action = QDNS_MSG_DROP;
+			of[k++] = i;
+			c.in_off += 2 + len;
+		}
+
+		if (has_query(c))
+			ready[kept++] = i;
+		else
+			c.ready = 0;
+	}
+	ready.resize(kept);
+	nof = k;
+
+	return k;
+}
+
+
+// Each reply is written right away with its length in front, unless
+// earlier replies to the same peer are still queued; whatever does not
+// fit into the socket is queued after them.
+int tcp_provider::reply(vector<dns_msg> &msgs, int n)
+{
+	int failed = 0;
+
+	for (int i = 0; i < n && i < (int)nof; ++i) {
+		dns_msg &msg = msgs[i];
+		if (msg.action != QDNS_MSG_REPLY)
+			continue;
+
+		size_t ci = of[i];
+		conn &c = conns[ci];
+		if (c.fd < 0)
+			continue;
+
+		uint16_t len = htons(msg.rlen);
+		iovec iov[1 + dns_msg::reply_iovs];
+		iov[0].iov_base = &len;
+		iov[0].iov_len = sizeof(len);
+		msg.reply_iov(iov + 1);
+
+		size_t total = sizeof(len) + msg.rlen, written = 0;
+
+		if (c.out.empty()) {
+			msghdr mh;
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = iov;
+			mh.msg_iovlen = 1 + dns_msg::reply_iovs;
+
+			ssize_t r = sendmsg(c.fd, &mh, MSG_NOSIGNAL);
+			if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				build_error("reply: sendmsg");
+				++failed;
+				close_conn(ci);
+				continue;
+			}
+			written = r > 0 ? r : 0;
+		}
+
+		if (written == total)
+			continue;
+
+		if (c.out.size() + total - written > tcp_max_out) {
+			errno = 0;
+			build_error("reply: peer does not take its replies, closing");
+			++failed;
+			close_conn(ci);
+			continue;
+		}
+
+		try {
+			size_t skip = written;
+			for (auto &v : iov) {
+				if (skip >= v.iov_len) {
+					skip -= v.iov_len;
+					continue;
+				}
+				c.out.append(static_cast<const char *>(v.iov_base) + skip, v.iov_len - skip);
+				skip = 0;
+			}
+		} catch (...) {
+			close_conn(ci);
+			continue;
+		}
+
+		watch(ci);
+	}
+
+	return failed ? -1 : 0;
+}
+
+
+} // namespace
+
+#endif
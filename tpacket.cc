@@ -0,0 +1,691 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "provider.h"
+
+#ifdef QDNS_HAVE_TPACKET
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <pcap.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "misc.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+// where the frame data starts in a TX ring slot
+const size_t tpacket_tx_off = TPACKET2_HDRLEN - sizeof(sockaddr_ll);
+
+// ethernet header with a VLAN tag
+const size_t tpacket_max_l2 = ETH_HLEN + 4;
+
+// IPv6 + UDP header, the most build_resend() writes
+const size_t tpacket_max_hdr = sizeof(ip6_hdr) + sizeof(udphdr);
+
+
+tpacket_provider::~tpacket_provider()
+{
+	if (ring)
+		munmap(ring, ring_len);
+	if (txring)
+		munmap(txring, txring_len);
+	if (sock >= 0)
+		close(sock);
+	if (txsock >= 0)
+		close(txsock);
+	if (rawsock >= 0)
+		close(rawsock);
+}
+
+
+int tpacket_provider::init(const map<string, string> &args)
+{
+	string dev = "eth0", f = "ip and udp and dst port 53 ";
+
+	auto it = args.find("mon");
+	if (it != args.end())
+		dev = it->second;
+
+	if (args.count("6") > 0) {
+		f = "ip6 and udp and dst port 53 ";
+		family = AF_INET6;
+	}
+
+	if ((it = args.find("filter")) != args.end())
+		f = it->second;
+
+	if ((it = args.find("batch")) != args.end())
+		batch = strtoul(it->second.c_str(), NULL, 10);
+	if (batch == 0)
+		batch = 1;
+
+	unsigned int ifindex = if_nametoindex(dev.c_str());
+	if (ifindex == 0)
+		return build_error("init: no such device " + dev);
+
+	// protocol 0: nothing is queued before the filter and ring are set up
+	if ((sock = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+		return build_error("init: socket");
+
+	// the filter is compiled for ethernet framing, as libpcap would for this device
+	ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", dev.c_str());
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0)
+		return build_error("init: ioctl(SIOCGIFHWADDR)");
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)
+		return build_error("init: not an ethernet device: " + dev);
+	if (ioctl(sock, SIOCGIFMTU, &ifr) < 0)
+		return build_error("init: ioctl(SIOCGIFMTU)");
+	mtu = ifr.ifr_mtu;
+
+	pcap_t *dead = pcap_open_dead(DLT_EN10MB, 65535);
+	if (!dead)
+		return build_error("init: pcap_open_dead");
+	bpf_program bpf;
+	if (pcap_compile(dead, &bpf, f.c_str(), 1, PCAP_NETMASK_UNKNOWN) < 0) {
+		string e = pcap_geterr(dead);
+		pcap_close(dead);
+		return build_error("init: filter: " + e);
+	}
+	pcap_close(dead);
+
+	// struct bpf_insn and struct sock_filter are the same thing
+	sock_fprog fprog;
+	fprog.len = bpf.bf_len;
+	fprog.filter = reinterpret_cast<sock_filter *>(bpf.bf_insns);
+	int r = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+	pcap_freecode(&bpf);
+	if (r < 0)
+		return build_error("init: setsockopt(SO_ATTACH_FILTER)");
+
+	int v = TPACKET_V3;
+	if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0)
+		return build_error("init: setsockopt(PACKET_VERSION)");
+
+	// Frames are packed back to back into the blocks, so a 1MB block
+	// holds thousands of queries. A block is handed to us when it is full
+	// or after the timeout, which bounds the latency at low rates.
+	tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = block_size;
+	req.tp_block_nr = nblocks;
+	req.tp_frame_size = 2048;
+	req.tp_frame_nr = (block_size * nblocks) / req.tp_frame_size;
+	req.tp_retire_blk_tov = 1;
+	if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+		return build_error("init: setsockopt(PACKET_RX_RING)");
+
+	ring_len = block_size * nblocks;
+	void *m = mmap(nullptr, ring_len, PROT_READ|PROT_WRITE, MAP_SHARED, sock, 0);
+	if (m == MAP_FAILED)
+		return build_error("init: mmap");
+	ring = reinterpret_cast<char *>(m);
+
+	sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(family == AF_INET6 ? ETH_P_IPV6 : ETH_P_IP);
+	sll.sll_ifindex = ifindex;
+	if (::bind(sock, reinterpret_cast<sockaddr *>(&sll), sizeof(sll)) < 0)
+		return build_error("init: bind");
+
+	// Several workers capturing on the same device: each frame goes to
+	// one socket of the group only. Hashing keeps every flow on the same
+	// worker; by CPU follows the NIC's RSS queues.
+	if ((it = args.find("fanout")) != args.end()) {
+		int mode = PACKET_FANOUT_HASH;
+		auto m = args.find("fanout_mode");
+		if (m != args.end() && m->second == "cpu")
+			mode = PACKET_FANOUT_CPU;
+		else if (m != args.end() && m->second != "hash")
+			return build_error("init: unknown fanout mode " + m->second);
+
+		int fanout = (strtoul(it->second.c_str(), NULL, 10) & 0xffff) | (mode << 16);
+		if (setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0)
+			return build_error("init: setsockopt(PACKET_FANOUT)");
+	}
+
+	if ((txsock = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+		return build_error("init: socket");
+
+	v = TPACKET_V2;
+	if (setsockopt(txsock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0)
+		return build_error("init: setsockopt(PACKET_VERSION)");
+
+	// drop frames the kernel refuses rather than stalling the ring
+	int one = 1;
+	if (setsockopt(txsock, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0)
+		return build_error("init: setsockopt(PACKET_LOSS)");
+
+	// spoofed answers race the real ones, so skip the qdisc if we may
+	setsockopt(txsock, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+	// each slot takes a full sized frame
+	while (tx_frame_size < tpacket_tx_off + tpacket_max_l2 + mtu)
+		tx_frame_size <<= 1;
+
+	tpacket_req treq;
+	memset(&treq, 0, sizeof(treq));
+	treq.tp_frame_size = tx_frame_size;
+	treq.tp_frame_nr = tx_nframes;
+	treq.tp_block_size = tx_frame_size > (1<<16) ? tx_frame_size : (1<<16);
+	treq.tp_block_nr = (tx_frame_size * tx_nframes) / treq.tp_block_size;
+	if (setsockopt(txsock, SOL_PACKET, PACKET_TX_RING, &treq, sizeof(treq)) < 0)
+		return build_error("init: setsockopt(PACKET_TX_RING)");
+
+	txring_len = tx_frame_size * tx_nframes;
+	if ((m = mmap(nullptr, txring_len, PROT_READ|PROT_WRITE, MAP_SHARED, txsock, 0)) == MAP_FAILED)
+		return build_error("init: mmap");
+	txring = reinterpret_cast<char *>(m);
+
+	// protocol 0 again, so nothing is received on it; the protocol of
+	// the frames is given with each sendto()
+	sll.sll_protocol = 0;
+	if (::bind(txsock, reinterpret_cast<sockaddr *>(&sll), sizeof(sll)) < 0)
+		return build_error("init: bind");
+	sll.sll_protocol = htons(family == AF_INET6 ? ETH_P_IPV6 : ETH_P_IP);
+	memcpy(&txaddr, &sll, sizeof(sll));
+
+	// reply header template
+	udphdr udp;
+	memset(&udp, 0, sizeof(udp));
+	if (family == AF_INET) {
+		iphdr ip;
+		memset(&ip, 0, sizeof(ip));
+		ip.version = 4;
+		ip.ihl = sizeof(ip)/4;
+		ip.frag_off = htons(IP_DF);
+		ip.ttl = 64;
+		ip.protocol = IPPROTO_UDP;
+		tmpl_sum = cksum_add(0, &ip, sizeof(ip));
+		memcpy(tmpl, &ip, sizeof(ip));
+		tmpl_len = sizeof(ip);
+	} else {
+		ip6_hdr ip6;
+		memset(&ip6, 0, sizeof(ip6));
+		ip6.ip6_flow = htonl(6<<28);
+		ip6.ip6_nxt = IPPROTO_UDP;
+		ip6.ip6_hlim = 64;
+		memcpy(tmpl, &ip6, sizeof(ip6));
+		tmpl_len = sizeof(ip6);
+	}
+	memcpy(tmpl + tmpl_len, &udp, sizeof(udp));
+	tmpl_len += sizeof(udp);
+
+	// IPPROTO_RAW implies we pass the IP header, on Linux also for IPv6
+	if (args.count("resend") > 0) {
+		if ((rawsock = socket(family, SOCK_RAW, IPPROTO_RAW)) < 0)
+			return build_error("init: socket(SOCK_RAW)");
+
+		try {
+			rawhdr.resize(batch);
+			rawiov.resize(2*batch);
+			rawdst.resize(batch);
+			rawhdrs.resize(batch * tpacket_max_hdr);
+		} catch (...) {
+			return build_error("init: OOM");
+		}
+	}
+
+	return 0;
+}
+
+
+// give all blocks back that recv() has read completely
+void tpacket_provider::release()
+{
+	size_t keep = left > 0 ? 1 : 0;
+
+	for (; nheld > keep; --nheld) {
+		__atomic_store_n(&block(head)->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		head = (head + 1) % nblocks;
+	}
+}
+
+
+// frame -> msg without copying the payload. Everything that is not a
+// complete UDP datagram of our family is skipped; which ports and
+// addresses we answer is up to the filter.
+bool tpacket_provider::parse(const tpacket3_hdr *h, dns_msg &msg)
+{
+	if (h->tp_snaplen < h->tp_len || h->tp_net < h->tp_mac + ETH_HLEN ||
+	    (uint32_t)(h->tp_net - h->tp_mac) > h->tp_snaplen)
+		return 0;
+
+	const char *pkt = reinterpret_cast<const char *>(h) + h->tp_net;
+	size_t len = h->tp_snaplen - (h->tp_net - h->tp_mac);
+
+	if (family == AF_INET) {
+		iphdr ip;
+		if (len < sizeof(ip))
+			return 0;
+		memcpy(&ip, pkt, sizeof(ip));
+
+		size_t hlen = ip.ihl * 4, tlen = ntohs(ip.tot_len);
+		if (ip.version != 4 || ip.protocol != IPPROTO_UDP || hlen < sizeof(ip))
+			return 0;
+		// ethernet pads short frames, so go by the IP length
+		if (tlen > len || tlen < hlen + sizeof(udphdr))
+			return 0;
+		// fragments do not carry a complete query
+		if (ntohs(ip.frag_off) & (IP_MF|IP_OFFMASK))
+			return 0;
+		pkt += hlen;
+		len = tlen - hlen;
+
+		sockaddr_in *from = reinterpret_cast<sockaddr_in *>(&msg.peer);
+		sockaddr_in *to = reinterpret_cast<sockaddr_in *>(&msg.local);
+		from->sin_family = to->sin_family = AF_INET;
+		from->sin_addr.s_addr = ip.saddr;
+		to->sin_addr.s_addr = ip.daddr;
+		msg.plen = sizeof(*from);
+	} else {
+		ip6_hdr ip6;
+		if (len < sizeof(ip6))
+			return 0;
+		memcpy(&ip6, pkt, sizeof(ip6));
+
+		size_t plen = ntohs(ip6.ip6_plen);
+		if ((ip6.ip6_vfc>>4) != 6 || ip6.ip6_nxt != IPPROTO_UDP)
+			return 0;
+		if (plen > len - sizeof(ip6) || plen < sizeof(udphdr))
+			return 0;
+		pkt += sizeof(ip6);
+		len = plen;
+
+		sockaddr_in6 *from = reinterpret_cast<sockaddr_in6 *>(&msg.peer);
+		sockaddr_in6 *to = reinterpret_cast<sockaddr_in6 *>(&msg.local);
+		from->sin6_family = to->sin6_family = AF_INET6;
+		memcpy(&from->sin6_addr, &ip6.ip6_src, sizeof(from->sin6_addr));
+		memcpy(&to->sin6_addr, &ip6.ip6_dst, sizeof(to->sin6_addr));
+		msg.plen = sizeof(*from);
+	}
+
+	udphdr udp;
+	memcpy(&udp, pkt, sizeof(udp));
+	size_t ulen = ntohs(udp.len);
+	if (ulen < sizeof(udp) || ulen > len)
+		return 0;
+
+	// ports at the same place for both families
+	reinterpret_cast<sockaddr_in *>(&msg.peer)->sin_port = udp.source;
+	reinterpret_cast<sockaddr_in *>(&msg.local)->sin_port = udp.dest;
+
+	msg.qbuf = pkt + sizeof(udp);
+	msg.qlen = ulen - sizeof(udp);
+	msg.rlen = 0;
+	msg.action = QDNS_MSG_DROP;
+
+	return 1;
+}
+
+
+int tpacket_provider::recv(vector<dns_msg> &msgs)
+{
+	if (!ring)
+		return build_error("recv: tpacket_provider not initialized");
+
+	// the engine is done with the last batch
+	release();
+
+	if (frames.size() < msgs.size()) {
+		try {
+			frames.resize(msgs.size());
+		} catch (...) {
+			return build_error("recv: OOM");
+		}
+	}
+
+	size_t n = 0;
+	while (n < msgs.size()) {
+		if (left == 0) {
+			// nothing of this batch points into the drained blocks
+			if (n == 0)
+				release();
+			if (nheld == nblocks)
+				break;
+
+			tpacket_block_desc *b = block((head + nheld) % nblocks);
+			if (!(__atomic_load_n(&b->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+				// block for the first one, then take whatever else is ready
+				if (n > 0)
+					break;
+				pollfd pfd = {sock, POLLIN|POLLERR, 0};
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					return build_error("recv: poll");
+				continue;
+			}
+
+			++nheld;
+			left = b->hdr.bh1.num_pkts;
+			frame = reinterpret_cast<const char *>(b) + b->hdr.bh1.offset_to_first_pkt;
+			continue;
+		}
+
+		const tpacket3_hdr *h = reinterpret_cast<const tpacket3_hdr *>(frame);
+		frame += h->tp_next_offset;
+		--left;
+
+		if (parse(h, msgs[n]))
+			frames[n++] = h;
+	}
+
+	return n;
+}
+
+
+// next free TX slot's frame data, or nullptr if the kernel has
+// not yet sent what is queued there
+char *tpacket_provider::tx_frame()
+{
+	tpacket2_hdr *t = reinterpret_cast<tpacket2_hdr *>(txring + tx_next * tx_frame_size);
+
+	if (__atomic_load_n(&t->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+		flush();
+		if (__atomic_load_n(&t->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+			return nullptr;
+	}
+	return reinterpret_cast<char *>(t) + tpacket_tx_off;
+}
+
+
+// hand the queued slots to the kernel and wait until they are sent
+int tpacket_provider::flush()
+{
+	if (tx_pending == 0)
+		return 0;
+	tx_pending = 0;
+	if (sendto(txsock, nullptr, 0, 0, reinterpret_cast<sockaddr *>(&txaddr), sizeof(sockaddr_ll)) < 0)
+		return build_error("flush: sendto");
+	return 0;
+}
+
+
+// L2 header of a reply to the captured frame h: its MAC addresses
+// swapped, with its VLAN tag if the kernel stripped one
+static size_t l2_header(char *buf, const tpacket3_hdr *h)
+{
+	const char *eth = reinterpret_cast<const char *>(h) + h->tp_mac;
+	size_t len = 2*ETH_ALEN;
+
+	memcpy(buf, eth + ETH_ALEN, ETH_ALEN);
+	memcpy(buf + ETH_ALEN, eth, ETH_ALEN);
+
+	if (h->tp_status & TP_STATUS_VLAN_VALID) {
+		uint16_t tag[2] = {htons(ETH_P_8021Q), htons(h->hv1.tp_vlan_tci)};
+		if (h->tp_status & TP_STATUS_VLAN_TPID_VALID)
+			tag[0] = htons(h->hv1.tp_vlan_tpid);
+		memcpy(buf + len, tag, sizeof(tag));
+		len += sizeof(tag);
+	}
+
+	// ethertype of the original frame
+	memcpy(buf + len, eth + 2*ETH_ALEN, 2);
+	return len + 2;
+}
+
+
+// Reply frame to the query msg was parsed from: the template with the
+// flow's addresses, ports and lengths filled in. The checksums start
+// from the template's sum and only add what differs per packet, then
+// the reply payload.
+size_t tpacket_provider::build(char *buf, const tpacket3_hdr *h, const dns_msg &msg)
+{
+	size_t len = l2_header(buf, h);
+	char *ptr = buf + len;
+
+	memcpy(ptr, tmpl, tmpl_len);
+
+	udphdr udp;
+	udp.source = reinterpret_cast<const sockaddr_in *>(&msg.local)->sin_port;
+	udp.dest = reinterpret_cast<const sockaddr_in *>(&msg.peer)->sin_port;
+	udp.len = htons(sizeof(udp) + msg.rlen);
+
+	uint32_t addrs = 0;
+	if (family == AF_INET) {
+		uint32_t saddr = reinterpret_cast<const sockaddr_in *>(&msg.local)->sin_addr.s_addr;
+		uint32_t daddr = reinterpret_cast<const sockaddr_in *>(&msg.peer)->sin_addr.s_addr;
+		uint16_t tot_len = htons(sizeof(iphdr) + sizeof(udp) + msg.rlen);
+
+		memcpy(ptr + offsetof(iphdr, saddr), &saddr, sizeof(saddr));
+		memcpy(ptr + offsetof(iphdr, daddr), &daddr, sizeof(daddr));
+		memcpy(ptr + offsetof(iphdr, tot_len), &tot_len, sizeof(tot_len));
+		addrs = cksum_add(0, ptr + offsetof(iphdr, saddr), 2*sizeof(saddr));
+
+		uint16_t check = cksum_fold(tmpl_sum + addrs + tot_len);
+		memcpy(ptr + offsetof(iphdr, check), &check, sizeof(check));
+		ptr += sizeof(iphdr);
+	} else {
+		const in6_addr &saddr = reinterpret_cast<const sockaddr_in6 *>(&msg.local)->sin6_addr;
+		const in6_addr &daddr = reinterpret_cast<const sockaddr_in6 *>(&msg.peer)->sin6_addr;
+
+		memcpy(ptr + offsetof(ip6_hdr, ip6_src), &saddr, sizeof(saddr));
+		memcpy(ptr + offsetof(ip6_hdr, ip6_dst), &daddr, sizeof(daddr));
+		memcpy(ptr + offsetof(ip6_hdr, ip6_plen), &udp.len, sizeof(udp.len));
+		addrs = cksum_add(0, ptr + offsetof(ip6_hdr, ip6_src), 2*sizeof(saddr));
+		ptr += sizeof(ip6_hdr);
+	}
+
+	// the reply is gathered right into the frame and summed there;
+	// then pseudo header and UDP header
+	char *payload = ptr + sizeof(udp);
+	msg.gather(payload);
+	uint32_t sum = addrs + htons(IPPROTO_UDP) + udp.len;
+	sum += udp.source + udp.dest + udp.len;
+	sum = cksum_add(sum, payload, msg.rlen);
+	if ((udp.check = cksum_fold(sum)) == 0)
+		udp.check = 0xffff;
+
+	memcpy(ptr, &udp, sizeof(udp));
+	ptr = payload + msg.rlen;
+
+	return ptr - buf;
+}
+
+
+// Replies go from local to peer, through the TX ring
+int tpacket_provider::reply(vector<dns_msg> &msgs, int n)
+{
+	if (!txring)
+		return build_error("reply: tpacket_provider not initialized");
+
+	int failed = 0;
+
+	for (int i = 0; i < n && i < (int)frames.size(); ++i) {
+		dns_msg &msg = msgs[i];
+		if (msg.action != QDNS_MSG_REPLY)
+			continue;
+
+		// what goes after the L2 header
+		if (tmpl_len + msg.rlen > mtu) {
+			errno = EMSGSIZE;
+			build_error("reply: frame exceeds MTU");
+			++failed;
+			continue;
+		}
+
+		char *buf = tx_frame();
+		if (!buf) {
+			errno = ENOBUFS;
+			build_error("reply: TX ring full");
+			++failed;
+			continue;
+		}
+
+		size_t len = build(buf, frames[i], msg);
+
+		tpacket2_hdr *t = reinterpret_cast<tpacket2_hdr *>(buf - tpacket_tx_off);
+		t->tp_len = len;
+		__atomic_store_n(&t->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+		tx_next = (tx_next + 1) % tx_nframes;
+		++tx_pending;
+	}
+
+	// one syscall for the whole batch
+	if (flush() < 0)
+		++failed;
+
+	return failed ? -1 : 0;
+}
+
+
+// IP and UDP header of a resent query, from peer to local. The kernel
+// fills in the IPv4 ID and header checksum, the UDP checksum is ours.
+size_t tpacket_provider::build_resend(char *hdr, const dns_msg &msg)
+{
+	const sockaddr_storage &src = msg.peer, &dst = msg.local;
+
+	udphdr udp;
+	udp.source = reinterpret_cast<const sockaddr_in *>(&src)->sin_port;
+	udp.dest = reinterpret_cast<const sockaddr_in *>(&dst)->sin_port;
+	udp.len = htons(sizeof(udp) + msg.qlen);
+	udp.check = 0;
+
+	// pseudo header: addresses, protocol and UDP length
+	uint32_t sum = htons(IPPROTO_UDP) + udp.len;
+	size_t hlen = 0;
+
+	if (family == AF_INET) {
+		iphdr ip;
+		memset(&ip, 0, sizeof(ip));
+		ip.version = 4;
+		ip.ihl = sizeof(ip)/4;
+		ip.tot_len = htons(sizeof(ip) + sizeof(udp) + msg.qlen);
+		ip.ttl = 64;
+		ip.protocol = IPPROTO_UDP;
+		ip.saddr = reinterpret_cast<const sockaddr_in *>(&src)->sin_addr.s_addr;
+		ip.daddr = reinterpret_cast<const sockaddr_in *>(&dst)->sin_addr.s_addr;
+		sum = cksum_add(sum, &ip.saddr, 2*sizeof(ip.saddr));
+		memcpy(hdr, &ip, sizeof(ip));
+		hlen = sizeof(ip);
+	} else {
+		ip6_hdr ip6;
+		memset(&ip6, 0, sizeof(ip6));
+		ip6.ip6_flow = htonl(6<<28);
+		ip6.ip6_plen = udp.len;
+		ip6.ip6_nxt = IPPROTO_UDP;
+		ip6.ip6_hlim = 64;
+		memcpy(&ip6.ip6_src, &reinterpret_cast<const sockaddr_in6 *>(&src)->sin6_addr, sizeof(ip6.ip6_src));
+		memcpy(&ip6.ip6_dst, &reinterpret_cast<const sockaddr_in6 *>(&dst)->sin6_addr, sizeof(ip6.ip6_dst));
+		sum = cksum_add(sum, &ip6.ip6_src, 2*sizeof(ip6.ip6_src));
+		memcpy(hdr, &ip6, sizeof(ip6));
+		hlen = sizeof(ip6);
+	}
+
+	sum = cksum_add(sum, &udp, sizeof(udp));
+	sum = cksum_add(sum, msg.qbuf, msg.qlen);
+	if ((udp.check = cksum_fold(sum)) == 0)
+		udp.check = 0xffff;
+	memcpy(hdr + hlen, &udp, sizeof(udp));
+
+	return hlen + sizeof(udp);
+}
+
+
+// Resends go from peer to local. Sending the captured frame back out
+// the capture device would only return it to ourselves on a router, so
+// they take a raw IP socket and the routing table, as with usipp_provider.
+int tpacket_provider::resend(vector<dns_msg> &msgs, int n)
+{
+	int ntx = 0, r = 0, failed = 0;
+
+	for (int i = 0; i < n && ntx < (int)rawhdr.size(); ++i) {
+		dns_msg &msg = msgs[i];
+		if (msg.action != QDNS_MSG_RESEND)
+			continue;
+
+		char *hdr = &rawhdrs[ntx * tpacket_max_hdr];
+		size_t hlen = build_resend(hdr, msg);
+
+		memcpy(&rawdst[ntx], &msg.local, sizeof(msg.local));
+		reinterpret_cast<sockaddr_in *>(&rawdst[ntx])->sin_port = 0;
+
+		rawiov[2*ntx].iov_base = hdr;
+		rawiov[2*ntx].iov_len = hlen;
+		rawiov[2*ntx + 1].iov_base = const_cast<char *>(msg.qbuf);
+		rawiov[2*ntx + 1].iov_len = msg.qlen;
+		memset(&rawhdr[ntx], 0, sizeof(rawhdr[ntx]));
+		rawhdr[ntx].msg_hdr.msg_iov = &rawiov[2*ntx];
+		rawhdr[ntx].msg_hdr.msg_iovlen = 2;
+		rawhdr[ntx].msg_hdr.msg_name = &rawdst[ntx];
+		rawhdr[ntx].msg_hdr.msg_namelen = family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+		++ntx;
+	}
+
+	// as in socket_provider, skip datagrams that fail
+	for (int i = 0; i < ntx;) {
+		if ((r = sendmmsg(rawsock, &rawhdr[i], ntx - i, 0)) < 0) {
+			build_error("resend: sendmmsg");
+			++failed;
+			++i;
+			continue;
+		}
+		i += r;
+	}
+
+	return failed ? -1 : 0;
+}
+
+
+// as for usipp_provider, peers are hosts on the wire
+size_t tpacket_provider::sender(const sockaddr *peer, char *buf, size_t len) const
+{
+	return host(peer, buf, len);
+}
+
+
+int tpacket_provider::build_error(const string &s)
+{
+	err = "tpacket_provider::";
+	err += s;
+	if (errno) {
+		err += ": ";
+		err += strerror(errno);
+	}
+	return -1;
+}
+
+
+} // namespace
+
+#endif
+
@@ -0,0 +1,483 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "provider.h"
+
+#ifdef QDNS_HAVE_URING
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+using namespace std;
+
+namespace qdns {
+
+
+// user_data of the SQEs
+enum : uint64_t {
+	uring_recv = 1,
+	uring_send = 2
+};
+
+
+static int uring_setup(unsigned entries, io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+	return syscall(SYS_io_uring_register, fd, op, arg, nargs);
+}
+
+
+int uring_provider::init(const map<string, string> &args)
+{
+	if (socket_provider::init(args) < 0)
+		return -1;
+
+	if (setup() < 0) {
+		cerr<<why()<<", using recvmmsg() instead\n";
+		teardown();
+		errno = 0;
+		err = "";
+	}
+
+	return 0;
+}
+
+
+int uring_provider::setup()
+{
+#ifdef IORING_RECV_MULTISHOT
+	// room for a whole batch of replies plus the re-armed receive
+	unsigned entries = 64;
+	while (entries < batch + 1)
+		entries <<= 1;
+
+	// every buffer may be waiting as a completion, plus the sends
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 2*nbufs;
+
+	if ((ring_fd = uring_setup(entries, &p)) < 0)
+		return build_error("setup: io_uring_setup");
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		return build_error("setup: kernel too old");
+
+	sq_entries = p.sq_entries;
+	rings_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	if (rings_len < p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe))
+		rings_len = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+
+	void *m = mmap(nullptr, rings_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (m == MAP_FAILED)
+		return build_error("setup: mmap");
+	rings = m;
+
+	sqes_len = p.sq_entries*sizeof(io_uring_sqe);
+	if ((m = mmap(nullptr, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES)) == MAP_FAILED)
+		return build_error("setup: mmap");
+	sqes = m;
+
+	char *base = reinterpret_cast<char *>(rings);
+	sq_head = reinterpret_cast<unsigned *>(base + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned *>(base + p.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned *>(base + p.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned *>(base + p.sq_off.array);
+	cq_head = reinterpret_cast<unsigned *>(base + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(base + p.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned *>(base + p.cq_off.ring_mask);
+	cqes = base + p.cq_off.cqes;
+
+	// the buffer ring and the buffers themselves, each with room for
+	// the largest query we take, after what the kernel puts in front
+	buf_size = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + dns_max_query;
+	br_len = nbufs*sizeof(io_uring_buf);
+	if ((m = mmap(nullptr, br_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return build_error("setup: mmap");
+	br = m;
+	bufs_len = nbufs*buf_size;
+	if ((m = mmap(nullptr, bufs_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return build_error("setup: mmap");
+	bufs = reinterpret_cast<char *>(m);
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(br);
+	reg.ring_entries = nbufs;
+	reg.bgid = 0;
+	if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return build_error("setup: IORING_REGISTER_PBUF_RING");
+
+	for (size_t i = 0; i < nbufs; ++i)
+		give_back(i);
+	__atomic_store_n(&reinterpret_cast<io_uring_buf_ring *>(br)->tail, br_tail, __ATOMIC_RELEASE);
+
+	// what each received datagram looks like in its buffer: an
+	// io_uring_recvmsg_out, the peer address, then the payload
+	rxmsg.msg_namelen = sizeof(sockaddr_storage);
+	rxmsg.msg_controllen = 0;
+
+	try {
+		held.reserve(nbufs);
+		stash.reserve(p.cq_entries);
+		txmsg.resize(batch);
+	} catch (...) {
+		return build_error("setup: OOM");
+	}
+
+	return 0;
+#else
+	errno = ENOSYS;
+	return build_error("setup: built without multishot io_uring support");
+#endif
+}
+
+
+void uring_provider::teardown()
+{
+	if (ring_fd >= 0)
+		close(ring_fd);
+	if (rings)
+		munmap(rings, rings_len);
+	if (sqes)
+		munmap(sqes, sqes_len);
+	if (br)
+		munmap(br, br_len);
+	if (bufs)
+		munmap(bufs, bufs_len);
+	ring_fd = -1;
+	rings = sqes = br = nullptr;
+	bufs = nullptr;
+}
+
+
+// the next SQE to fill, submitting what is queued if the SQ is full
+void *uring_provider::get_sqe()
+{
+	unsigned tail = *sq_tail;
+
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+		if (enter(0, 0) < 0)
+			return nullptr;
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			return nullptr;
+	}
+
+	unsigned idx = tail & *sq_mask;
+	io_uring_sqe *sqe = reinterpret_cast<io_uring_sqe *>(sqes) + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++to_submit;
+
+	return sqe;
+}
+
+
+// submit what is queued and wait for min_complete completions
+int uring_provider::enter(unsigned min_complete, unsigned flags)
+{
+	int r = 0;
+
+	if (min_complete > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	do {
+		r = uring_enter(ring_fd, to_submit, min_complete, flags);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return build_error("enter: io_uring_enter");
+
+	to_submit -= r < (int)to_submit ? r : to_submit;
+	return 0;
+}
+
+
+bool uring_provider::next_cqe(cqe &c)
+{
+	if (stash_pos < stash.size()) {
+		c = stash[stash_pos++];
+		if (stash_pos == stash.size()) {
+			stash.clear();
+			stash_pos = 0;
+		}
+		return 1;
+	}
+
+	unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	const io_uring_cqe *e = reinterpret_cast<const io_uring_cqe *>(cqes) + (head & *cq_mask);
+	c.data = e->user_data;
+	c.res = e->res;
+	c.flags = e->flags;
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+
+// buffer bid may be used by the kernel again once br's tail is published.
+// The entries are addressed by hand: in C++, io_uring_buf_ring::bufs does
+// not start at offset 0 as the kernel expects.
+void uring_provider::give_back(uint16_t bid)
+{
+	io_uring_buf *b = reinterpret_cast<io_uring_buf *>(br) + (br_tail & (nbufs - 1));
+
+	b->addr = reinterpret_cast<uint64_t>(bufs + bid*buf_size);
+	b->len = buf_size;
+	b->bid = bid;
+	++br_tail;
+}
+
+
+bool uring_provider::parse(const cqe &c, dns_msg &msg)
+{
+	if (c.res < 0 || !(c.flags & IORING_CQE_F_BUFFER))
+		return 0;
+
+	uint16_t bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+	const char *buf = bufs + bid*buf_size;
+
+	io_uring_recvmsg_out out;
+	memcpy(&out, buf, sizeof(out));
+
+	const char *payload = buf + sizeof(out) + rxmsg.msg_namelen + rxmsg.msg_controllen;
+
+	// too large for the buffer, as it would have been for dns_msg::query
+	if ((out.flags & MSG_TRUNC) || out.namelen > sizeof(msg.peer) ||
+	    payload + out.payloadlen > buf + c.res) {
+		give_back(bid);
+		return 0;
+	}
+
+	memcpy(&msg.peer, buf + sizeof(out), out.namelen);
+	msg.plen = out.namelen;
+	msg.qbuf = payload;
+	msg.qlen = out.payloadlen;
+	msg.rlen = 0;
+	msg.action = QDNS_MSG_DROP;
+	held.push_back(bid);
+
+	return 1;
+}
+
+
+int uring_provider::recv(vector<dns_msg> &msgs)
+{
+	if (ring_fd < 0)
+		return socket_provider::recv(msgs);
+
+	// the engine is done with the buffers of the last batch
+	for (auto bid : held)
+		give_back(bid);
+	held.clear();
+
+	io_uring_buf_ring *ring = reinterpret_cast<io_uring_buf_ring *>(br);
+	size_t n = 0;
+	int failed = 0;
+	cqe c;
+
+	while (n == 0) {
+		if (!armed) {
+			io_uring_sqe *sqe = reinterpret_cast<io_uring_sqe *>(get_sqe());
+			if (!sqe)
+				return build_error("recv: SQ full");
+			sqe->opcode = IORING_OP_RECVMSG;
+			sqe->fd = sock;
+			sqe->addr = reinterpret_cast<uint64_t>(&rxmsg);
+			sqe->len = 1;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			sqe->user_data = uring_recv;
+			armed = 1;
+		}
+
+		__atomic_store_n(&ring->tail, br_tail, __ATOMIC_RELEASE);
+
+		while (n < msgs.size() && next_cqe(c)) {
+			if (c.data == uring_send) {
+				--inflight;
+				continue;
+			}
+
+			// multishot ended, e.g. because we ran out of buffers
+			if (!(c.flags & IORING_CQE_F_MORE))
+				armed = 0;
+
+			if (c.res < 0 && c.res != -ENOBUFS) {
+				// kernel without multishot recvmsg, drop back to recvmmsg()
+				if (c.res == -EINVAL && n == 0) {
+					teardown();
+					return socket_provider::recv(msgs);
+				}
+				errno = -c.res;
+				build_error("recv: recvmsg");
+				++failed;
+				continue;
+			}
+
+			if (parse(c, msgs[n]))
+				++n;
+		}
+
+		if (n > 0 || failed)
+			break;
+
+		// re-arm first, as waiting for it would not return
+		if (!armed)
+			continue;
+
+		if (enter(1, 0) < 0)
+			return -1;
+	}
+
+	__atomic_store_n(&ring->tail, br_tail, __ATOMIC_RELEASE);
+
+	// a re-armed receive goes out now rather than with the replies
+	if (to_submit > 0 && enter(0, 0) < 0)
+		return -1;
+
+	if (n == 0 && failed)
+		return -1;
+	return n;
+}
+
+
+// The replies live in msgs, which the next batch writes to again, so
+// wait until the kernel is done with them. UDP sends mostly complete
+// right within the submitting syscall.
+int uring_provider::reap_sends()
+{
+	int failed = 0;
+	cqe c;
+
+	while (inflight > 0) {
+		unsigned head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			if (enter(1, 0) < 0)
+				return -1;
+			continue;
+		}
+
+		const io_uring_cqe *e = reinterpret_cast<const io_uring_cqe *>(cqes) + (head & *cq_mask);
+		c.data = e->user_data;
+		c.res = e->res;
+		c.flags = e->flags;
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (c.data != uring_send) {
+			stash.push_back(c);
+			continue;
+		}
+		--inflight;
+		if (c.res < 0) {
+			errno = -c.res;
+			build_error("reply: sendmsg");
+			++failed;
+		}
+	}
+
+	return failed ? -1 : 0;
+}
+
+
+int uring_provider::reply(vector<dns_msg> &msgs, int n)
+{
+	if (ring_fd < 0)
+		return socket_provider::reply(msgs, n);
+
+	int ntx = 0;
+
+	for (int i = 0; i < n && ntx < (int)txmsg.size(); ++i) {
+		dns_msg &msg = msgs[i];
+		if (msg.action != QDNS_MSG_REPLY)
+			continue;
+
+		io_uring_sqe *sqe = reinterpret_cast<io_uring_sqe *>(get_sqe());
+		if (!sqe)
+			break;
+
+		iovec *iov = &txiov[ntx*dns_msg::reply_iovs];
+		msg.reply_iov(iov);
+		memset(&txmsg[ntx], 0, sizeof(txmsg[ntx]));
+		txmsg[ntx].msg_name = &msg.peer;
+		txmsg[ntx].msg_namelen = msg.plen;
+		txmsg[ntx].msg_iov = iov;
+		txmsg[ntx].msg_iovlen = dns_msg::reply_iovs;
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock;
+		sqe->addr = reinterpret_cast<uint64_t>(&txmsg[ntx]);
+		sqe->len = 1;
+		sqe->user_data = uring_send;
+		++inflight;
+		++ntx;
+	}
+
+	if (ntx == 0)
+		return 0;
+
+	// one syscall for the whole batch
+	if (enter(0, 0) < 0)
+		return -1;
+
+	return reap_sends();
+}
+
+
+int uring_provider::build_error(const string &s)
+{
+	err = "uring_provider::";
+	err += s;
+	if (errno) {
+		err += ": ";
+		err += strerror(errno);
+	}
+	return -1;
+}
+
+
+} // namespace
+
+#endif
+
@@ -0,0 +1,1019 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "zone.h"
+#include "net-headers.h"
+
+
+using namespace std;
+
+namespace qdns {
+
+
+// max number of labels inside a 255 byte DNS name
+const int dns_max_labels = 128;
+
+
+// split wire format name into label offsets; returns number
+// of labels or -1 if the name is malformed or not terminated
+static int split_labels(const char *qname, size_t len, uint16_t *offs)
+{
+	size_t i = 0;
+	int n = 0;
+
+	for (;;) {
+		if (i >= len)
+			return -1;
+		uint8_t l = qname[i];
+		if (l == 0)
+			break;
+		if (l > 63 || i + 1 + l > len || n == dns_max_labels)
+			return -1;
+		offs[n++] = i;
+		i += l + 1;
+	}
+	return n;
+}
+
+
+int interner::grow()
+{
+	vector<entry> bigger;
+
+	try {
+		bigger.resize(table.size() ? 2*table.size() : 1024);
+	} catch (...) {
+		return -1;
+	}
+
+	size_t mask = bigger.size() - 1;
+	for (auto &e : table) {
+		if (e.len == 0)
+			continue;
+		size_t i = e.hash & mask;
+		while (bigger[i].len != 0)
+			i = (i + 1) & mask;
+		bigger[i] = e;
+	}
+	table.swap(bigger);
+	return 0;
+}
+
+
+int interner::add(string &store, const char *s, size_t len, uint32_t &off)
+{
+	if (store.size() + len > 0xffffffff)
+		return -1;
+	if (4*(used + 1) > 3*table.size() && grow() < 0)
+		return -1;
+
+	uint32_t h = name_index::hash64(s, len, 0);
+	size_t mask = table.size() - 1, i = h & mask;
+
+	for (; table[i].len != 0; i = (i + 1) & mask) {
+		const entry &e = table[i];
+		if (e.hash == h && e.len == len + 1 && memcmp(store.data() + e.off, s, len) == 0) {
+			off = e.off;
+			return 0;
+		}
+	}
+
+	try {
+		off = store.size();
+		store.append(s, len);
+	} catch (...) {
+		return -1;
+	}
+
+	table[i].hash = h;
+	table[i].off = off;
+	table[i].len = len + 1;
+	++used;
+	return 0;
+}
+
+
+uint32_t label_trie::hash(uint32_t parent, const char *label, uint8_t len)
+{
+	// FNV-1a over parent id and label
+	uint32_t h = 2166136261u;
+
+	for (int i = 0; i < 4; ++i) {
+		h ^= (parent>>(8*i)) & 0xff;
+		h *= 16777619u;
+	}
+	for (uint8_t i = 0; i < len; ++i) {
+		h ^= (uint8_t)label[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+void label_trie::sync()
+{
+	v.nodes = nodes.data();
+	v.edges = edges.data();
+	v.values = values.data();
+	v.labels = labels.c_str();
+	v.nedges = edges.size();
+}
+
+
+void label_trie::clear()
+{
+	// node 0 is the root, which is never a child, so a child of 0 marks
+	// an empty edge slot
+	nodes.assign(1, no_value);
+	edges.assign(64, edge());
+	values.clear();
+	labels.clear();
+	label_pool.clear();
+	used = 0;
+	sync();
+}
+
+
+uint32_t label_trie::child(uint32_t parent, const char *label, uint8_t len) const
+{
+	uint32_t h = hash(parent, label, len);
+	size_t mask = v.nedges - 1;
+
+	for (size_t i = h & mask;; i = (i + 1) & mask) {
+		const edge &e = v.edges[i];
+		if (e.child == 0)
+			return 0;
+		if (e.hash == h && e.parent == parent && e.label_len == len &&
+		    memcmp(v.labels + e.label_off, label, len) == 0)
+			return e.child;
+	}
+	return 0;
+}
+
+
+int label_trie::grow()
+{
+	vector<edge> bigger;
+
+	try {
+		bigger.resize(2*edges.size());
+	} catch (...) {
+		return -1;
+	}
+
+	size_t mask = bigger.size() - 1;
+	for (auto &e : edges) {
+		if (e.child == 0)
+			continue;
+		size_t i = e.hash & mask;
+		while (bigger[i].child != 0)
+			i = (i + 1) & mask;
+		bigger[i] = e;
+	}
+	edges.swap(bigger);
+	sync();
+	return 0;
+}
+
+
+int label_trie::insert(const string &qname, uint16_t qtype, uint16_t view, uint32_t val)
+{
+	uint16_t offs[dns_max_labels];
+	int n = split_labels(qname.c_str(), qname.size(), offs);
+
+	if (n < 0)
+		return -1;
+
+	uint32_t node = 0, c = 0;
+
+	try {
+		for (int i = n - 1; i >= 0; --i) {
+			const char *label = qname.c_str() + offs[i] + 1;
+			uint8_t len = qname[offs[i]];
+
+			if ((c = child(node, label, len)) != 0) {
+				node = c;
+				continue;
+			}
+
+			if (2*(used + 1) > edges.size() && grow() < 0)
+				return -1;
+
+			nodes.push_back(no_value);
+			c = nodes.size() - 1;
+
+			edge e;
+			memset(&e, 0, sizeof(e));
+			e.hash = hash(node, label, len);
+			e.parent = node;
+			e.child = c;
+			e.label_len = len;
+			if (label_pool.add(labels, label, len, e.label_off) < 0) {
+				sync();
+				return -1;
+			}
+
+			size_t mask = edges.size() - 1, j = e.hash & mask;
+			while (edges[j].child != 0)
+				j = (j + 1) & mask;
+			edges[j] = e;
+			++used;
+			sync();
+
+			node = c;
+		}
+
+		for (uint32_t i = nodes[node]; i != no_value; i = values[i].next) {
+			if (values[i].qtype == qtype && values[i].view == view) {
+				values[i].val = val;
+				return 0;
+			}
+		}
+
+		value nv;
+		memset(&nv, 0, sizeof(nv));
+		nv.qtype = qtype;
+		nv.view = view;
+		nv.val = val;
+		nv.next = nodes[node];
+		values.push_back(nv);
+		nodes[node] = values.size() - 1;
+	} catch (...) {
+		sync();
+		return -1;
+	}
+
+	sync();
+	return 0;
+}
+
+
+bool label_trie::find(const char *qname, size_t len, uint16_t qtype, uint16_t view, uint32_t &val) const
+{
+	uint16_t offs[dns_max_labels];
+	int n = split_labels(qname, len, offs);
+
+	if (n < 0)
+		return 0;
+
+	bool found = 0;
+	uint32_t node = 0;
+
+	for (int i = n;; --i) {
+		for (uint32_t j = v.nodes[node]; j != no_value; j = v.values[j].next) {
+			const value &x = v.values[j];
+			if (x.qtype == qtype && (x.view == view || x.view == 0)) {
+				val = x.val;
+				found = 1;
+				if (x.view == view)
+					break;
+			}
+		}
+
+		if (i == 0)
+			break;
+		if ((node = child(node, qname + offs[i - 1] + 1, qname[offs[i - 1]])) == 0)
+			break;
+	}
+
+	return found;
+}
+
+
+// eight bytes per round, with a murmur style finalizer
+uint64_t name_index::hash64(const char *name, size_t len, uint64_t seed)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len<<16) ^ seed, k = 0;
+	size_t i = 0;
+
+	for (; i + sizeof(k) <= len; i += sizeof(k)) {
+		memcpy(&k, name + i, sizeof(k));
+		h = (h ^ k) * 0xff51afd7ed558ccdULL;
+		h ^= h>>32;
+	}
+	k = 0;
+	memcpy(&k, name + i, len - i);
+	h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h>>29;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h>>32;
+	return h;
+}
+
+
+uint32_t name_index::hash(const char *name, size_t len, uint16_t qtype)
+{
+	return hash64(name, len, qtype);
+}
+
+
+void name_index::sync()
+{
+	v.slots = slots.data();
+	v.names = names.c_str();
+	v.nslots = slots.size();
+}
+
+
+void name_index::clear()
+{
+	slots.assign(64, slot());
+	names.clear();
+	name_pool.clear();
+	used = 0;
+	sync();
+}
+
+
+int name_index::grow()
+{
+	vector<slot> bigger;
+
+	try {
+		bigger.resize(2*slots.size());
+	} catch (...) {
+		return -1;
+	}
+
+	size_t mask = bigger.size() - 1;
+	for (auto &e : slots) {
+		if (e.name_len == 0)
+			continue;
+		size_t i = e.hash & mask;
+		while (bigger[i].name_len != 0)
+			i = (i + 1) & mask;
+		bigger[i] = e;
+	}
+	slots.swap(bigger);
+	sync();
+	return 0;
+}
+
+
+int name_index::reserve(size_t n)
+{
+	while (4*n > 3*slots.size()) {
+		if (grow() < 0)
+			return -1;
+	}
+	try {
+		names.reserve(n * 16);
+	} catch (...) {
+		return -1;
+	}
+	sync();
+	return 0;
+}
+
+
+int name_index::insert(const string &qname, uint16_t qtype, uint16_t view, uint32_t val)
+{
+	if (qname.size() == 0 || qname.size() > 255 || view > max_view)
+		return -1;
+
+	uint32_t h = hash(qname.c_str(), qname.size(), qtype);
+	size_t mask = slots.size() - 1, i = h & mask;
+
+	for (; slots[i].name_len != 0; i = (i + 1) & mask) {
+		const slot &e = slots[i];
+		if (e.hash == h && e.qtype == qtype && e.view == view && e.name_len == qname.size() &&
+		    memcmp(&names[e.name_off], qname.c_str(), qname.size()) == 0) {
+			slots[i].val = val;
+			return 0;
+		}
+	}
+
+	// keep load below 3/4, so probe sequences stay short
+	if (4*(used + 1) > 3*slots.size()) {
+		if (grow() < 0)
+			return -1;
+		return insert(qname, qtype, view, val);
+	}
+
+	slot e;
+	e.hash = h;
+	e.val = val;
+	e.qtype = qtype;
+	e.name_len = qname.size();
+	e.view = view;
+
+	if (name_pool.add(names, qname.c_str(), qname.size(), e.name_off) < 0)
+		return -1;
+
+	slots[i] = e;
+	++used;
+	sync();
+	return 0;
+}
+
+
+bool name_index::find(const char *qname, size_t len, uint16_t qtype, uint16_t view, uint32_t h, uint32_t &val) const
+{
+	if (len == 0 || len > 255)
+		return 0;
+
+	size_t mask = v.nslots - 1;
+	bool found = 0;
+
+	// an entry of view 0 may be followed by one of view
+	for (size_t i = h & mask; v.slots[i].name_len != 0; i = (i + 1) & mask) {
+		const slot &e = v.slots[i];
+		if (e.hash == h && e.qtype == qtype && (e.view == view || e.view == 0) && e.name_len == len &&
+		    memcmp(v.names + e.name_off, qname, len) == 0) {
+			val = e.val;
+			found = 1;
+			if (e.view == view)
+				break;
+		}
+	}
+	return found;
+}
+
+
+void name_filter::sync()
+{
+	v.blocks = blocks.empty() ? nullptr : blocks.data();
+	v.mask = blocks.empty() ? 0 : blocks.size()/block_words - 1;
+}
+
+
+void name_filter::clear()
+{
+	blocks.clear();
+	sync();
+}
+
+
+int name_filter::build(const vector<uint64_t> &keys)
+{
+	size_t n = 1;
+	while (n*block_bits < keys.size()*bits_per_key)
+		n <<= 1;
+
+	try {
+		blocks.assign(n*block_words, 0);
+	} catch (...) {
+		clear();
+		return -1;
+	}
+
+	for (auto key : keys) {
+		uint64_t *b = &blocks[block_words*((key>>32) & (n - 1))];
+		uint64_t g = (key ^ (key>>29)) * 0xbf58476d1ce4e5b9ULL;
+
+		for (int i = 0; i < probes; ++i, g >>= 9) {
+			unsigned bit = g & (block_bits - 1);
+			b[bit/64] |= 1ULL<<(bit % 64);
+		}
+	}
+	sync();
+	return 0;
+}
+
+
+void zone::sync()
+{
+	v.arena = arena.c_str();
+	v.answers = answers.data();
+	v.rrsets = rrsets.data();
+	v.nrrsets = rrsets.size();
+	v.fwds = fwds.data();
+	v.nfwds = fwds.size();
+}
+
+
+zone::~zone()
+{
+	if (map)
+		munmap(map, map_len);
+}
+
+
+int zone::add_answer(const string &rr, const string &field, uint32_t ttl,
+                     uint16_t a_count, uint16_t rra_count, uint16_t ad_count)
+{
+	// a loaded image is read-only
+	if (map)
+		return -1;
+
+	if (arena.size() + rr.size() + field.size() > 0xffffffff)
+		return -1;
+
+	answer a;
+	memset(&a, 0, sizeof(a));	// no random padding in images
+	a.rr_len = rr.size();
+	a.field_len = field.size();
+	a.ttl = ttl;
+
+	net_headers::dnshdr h;
+	h.qr = 1;
+	h.q_count = htons(1);
+	h.a_count = a_count;
+	h.rra_count = rra_count;
+	h.ad_count = ad_count;
+	static_assert(sizeof(h) == sizeof(a.hdr), "reply header template size");
+	memcpy(a.hdr, &h, sizeof(a.hdr));
+
+	if (arena_pool.add(arena, rr.c_str(), rr.size(), a.rr_off) < 0 ||
+	    arena_pool.add(arena, field.c_str(), field.size(), a.field_off) < 0) {
+		sync();
+		return -1;
+	}
+
+	try {
+		answers.push_back(a);
+	} catch (...) {
+		sync();
+		return -1;
+	}
+	sync();
+	return 0;
+}
+
+
+int zone::add_rrset(const string &qname, uint16_t qtype, bool wildcard, uint16_t view)
+{
+	if (map || pending == answers.size() || view > name_index::max_view)
+		return -1;
+
+	rrset rs;
+	rs.first = pending;
+	rs.count = answers.size() - pending;
+
+	uint32_t id = rrsets.size();
+
+	try {
+		rrsets.push_back(rs);
+		if (view >= fwds.size())
+			fwds.resize(view + 1, npos);
+	} catch (...) {
+		sync();
+		return -1;
+	}
+	sync();
+
+	// Wildcard owners end at their root label, as the suffixes that
+	// may_be_wild() hashes do; host2qname() encodes the root of "*"
+	// and "*." as two 0 bytes.
+	uint16_t offs[dns_max_labels];
+	int n = split_labels(qname.c_str(), qname.size(), offs);
+	size_t len = qname.size();
+	if (wildcard && n >= 0)
+		len = n == 0 ? 1 : offs[n - 1] + uint8_t(qname[offs[n - 1]]) + 2;
+
+	// the filters no longer hold everything, until built again
+	exact_filter.clear();
+	wild_filter.clear();
+	try {
+		(wildcard ? wild_keys : exact_keys).push_back(name_index::hash64(qname.c_str(), len, qtype));
+	} catch (...) {
+		return -1;
+	}
+
+	if (wildcard) {
+		if (wild.insert(qname.substr(0, len), qtype, view, id) < 0)
+			return -1;
+		if (n >= 0)
+			wild_depths[n/64] |= 1ULL<<(n % 64);
+	} else {
+		if (exact.insert(qname, qtype, view, id) < 0)
+			return -1;
+		if (qtype == htons(net_headers::dns_type::SOA) && qname == string("\x9[forward]\0", 11))
+			fwds[view] = id;
+	}
+
+	pending = answers.size();
+	return id;
+}
+
+
+int zone::add_network(int family, const void *addr, unsigned len, uint16_t view)
+{
+	if (map || view > name_index::max_view)
+		return -1;
+	if (family == AF_INET)
+		return nets4.add(static_cast<const uint8_t *>(addr), 4, len, view);
+	if (family == AF_INET6)
+		return nets6.add(static_cast<const uint8_t *>(addr), 16, len, view);
+	return -1;
+}
+
+
+int zone::finish()
+{
+	if (map || exact_filter.build(exact_keys) < 0 || wild_filter.build(wild_keys) < 0 ||
+	    nets4.build() < 0 || nets6.build() < 0)
+		return -1;
+
+	vector<uint64_t>().swap(exact_keys);
+	vector<uint64_t>().swap(wild_keys);
+	decltype(nets4.prefixes)().swap(nets4.prefixes);
+	decltype(nets6.prefixes)().swap(nets6.prefixes);
+	arena_pool.clear();
+	exact.name_pool.clear();
+	wild.label_pool.clear();
+	return 0;
+}
+
+
+// Whether one of qname's suffixes is in the wildcard filter.
+// Only suffixes with as many labels as some wildcard name are tested,
+// which are few in most zones, and none in zones without wildcards.
+bool zone::may_be_wild(const char *qname, size_t len, uint16_t qtype) const
+{
+	if ((wild_depths[0] | wild_depths[1]) == 0)
+		return 0;
+
+	uint16_t offs[dns_max_labels];
+	int n = split_labels(qname, len, offs);
+
+	// let the trie refuse it
+	if (n < 0)
+		return 1;
+
+	for (int d = 0; d <= n; ++d) {
+		if ((wild_depths[d/64] & (1ULL<<(d % 64))) == 0)
+			continue;
+
+		// the d rightmost labels, or just the root
+		size_t off = d == 0 ? len - 1 : offs[n - d];
+		if (wild_filter.test(name_index::hash64(qname + off, len - off, qtype)))
+			return 1;
+	}
+	return 0;
+}
+
+
+uint32_t zone::find(const char *qname, size_t len, uint16_t qtype, uint16_t view, bool &wildcard) const
+{
+	uint64_t h = name_index::hash64(qname, len, qtype);
+	uint32_t id = npos;
+
+	// the filters hold the names of all views
+	wildcard = 0;
+	if ((exact_filter.empty() || exact_filter.test(h)) && exact.find(qname, len, qtype, view, h, id))
+		return id;
+	if ((wild_filter.empty() || may_be_wild(qname, len, qtype)) && wild.find(qname, len, qtype, view, id))
+		wildcard = 1;
+	return id;
+}
+
+
+static uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t x = 0;
+	for (int i = 0; i < 8; ++i)
+		x = (x<<8) | p[i];
+	return x;
+}
+
+
+uint16_t zone::find_view(const sockaddr_storage &peer) const
+{
+	if (peer.ss_family == AF_INET) {
+		uint32_t a = ntohl(reinterpret_cast<const sockaddr_in *>(&peer)->sin_addr.s_addr);
+		return nets4.find(uint64_t(a)<<32, 0);
+	}
+	if (peer.ss_family != AF_INET6)
+		return 0;
+
+	const in6_addr &in6 = reinterpret_cast<const sockaddr_in6 *>(&peer)->sin6_addr;
+
+	// IPv4 clients of a dual stack socket
+	if (IN6_IS_ADDR_V4MAPPED(&in6))
+		return nets4.find(load_be64(in6.s6_addr + 8)<<32, 0);
+	return nets6.find(load_be64(in6.s6_addr), load_be64(in6.s6_addr + 8));
+}
+
+
+/* Zone image layout, all in host byte order:
+ *
+ * image_hdr, followed by the sections listed in it, each starting
+ * at a 64 byte aligned offset. Element sizes are recorded so that an
+ * image from a different ABI is refused rather than misread.
+ */
+
+namespace {
+
+const char image_magic[8] = {'Q', 'D', 'N', 'S', 'Z', 'I', 'M', 'G'};
+const uint32_t image_version = 4;
+const uint32_t image_byteorder = 0x01020304;
+
+enum {
+	SEC_ARENA = 0,
+	SEC_ANSWERS,
+	SEC_RRSETS,
+	SEC_EXACT_SLOTS,
+	SEC_EXACT_NAMES,
+	SEC_WILD_NODES,
+	SEC_WILD_EDGES,
+	SEC_WILD_VALUES,
+	SEC_WILD_LABELS,
+	SEC_EXACT_FILTER,
+	SEC_WILD_FILTER,
+	SEC_FORWARD,
+	SEC_NETS4_TOP,
+	SEC_NETS4_NODES,
+	SEC_NETS4_LEAVES,
+	SEC_NETS6_TOP,
+	SEC_NETS6_NODES,
+	SEC_NETS6_LEAVES,
+	SEC_MAX
+};
+
+struct image_hdr {
+	char magic[8];
+	uint32_t version, byteorder;
+	uint64_t exact_used, wild_used;
+	uint64_t wild_depths[2];
+	struct {
+		uint64_t off, len, esize;
+	} sec[SEC_MAX];
+};
+
+
+int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = static_cast<const char *>(buf);
+	ssize_t r = 0;
+
+	while (len > 0) {
+		if ((r = write(fd, ptr, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += r;
+		len -= r;
+	}
+	return 0;
+}
+
+}
+
+
+bool zone::is_image(const string &file)
+{
+	struct stat st;
+	char magic[sizeof(image_magic)];
+
+	// do not eat from pipes such as /dev/stdin
+	if (stat(file.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	bool r = (read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, image_magic, sizeof(magic)) == 0);
+	close(fd);
+	return r;
+}
+
+
+int zone::save(const string &file) const
+{
+	image_hdr hdr;
+	const void *data[SEC_MAX];
+
+	// only built zones can be saved, since a loaded one has no vectors
+	if (map) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, image_magic, sizeof(hdr.magic));
+	hdr.version = image_version;
+	hdr.byteorder = image_byteorder;
+	hdr.exact_used = exact.used;
+	hdr.wild_used = wild.used;
+	hdr.wild_depths[0] = wild_depths[0];
+	hdr.wild_depths[1] = wild_depths[1];
+
+	data[SEC_ARENA] = v.arena;
+	hdr.sec[SEC_ARENA].len = arena.size();
+	hdr.sec[SEC_ARENA].esize = 1;
+	data[SEC_ANSWERS] = v.answers;
+	hdr.sec[SEC_ANSWERS].len = answers.size() * sizeof(answer);
+	hdr.sec[SEC_ANSWERS].esize = sizeof(answer);
+	data[SEC_RRSETS] = v.rrsets;
+	hdr.sec[SEC_RRSETS].len = v.nrrsets * sizeof(rrset);
+	hdr.sec[SEC_RRSETS].esize = sizeof(rrset);
+	data[SEC_EXACT_SLOTS] = exact.v.slots;
+	hdr.sec[SEC_EXACT_SLOTS].len = exact.v.nslots * sizeof(name_index::slot);
+	hdr.sec[SEC_EXACT_SLOTS].esize = sizeof(name_index::slot);
+	data[SEC_EXACT_NAMES] = exact.v.names;
+	hdr.sec[SEC_EXACT_NAMES].len = exact.names.size();
+	hdr.sec[SEC_EXACT_NAMES].esize = 1;
+	data[SEC_WILD_NODES] = wild.v.nodes;
+	hdr.sec[SEC_WILD_NODES].len = wild.nodes.size() * sizeof(uint32_t);
+	hdr.sec[SEC_WILD_NODES].esize = sizeof(uint32_t);
+	data[SEC_WILD_EDGES] = wild.v.edges;
+	hdr.sec[SEC_WILD_EDGES].len = wild.v.nedges * sizeof(label_trie::edge);
+	hdr.sec[SEC_WILD_EDGES].esize = sizeof(label_trie::edge);
+	data[SEC_WILD_VALUES] = wild.v.values;
+	hdr.sec[SEC_WILD_VALUES].len = wild.values.size() * sizeof(label_trie::value);
+	hdr.sec[SEC_WILD_VALUES].esize = sizeof(label_trie::value);
+	data[SEC_WILD_LABELS] = wild.v.labels;
+	hdr.sec[SEC_WILD_LABELS].len = wild.labels.size();
+	hdr.sec[SEC_WILD_LABELS].esize = 1;
+	data[SEC_EXACT_FILTER] = exact_filter.v.blocks;
+	hdr.sec[SEC_EXACT_FILTER].len = exact_filter.blocks.size() * sizeof(uint64_t);
+	hdr.sec[SEC_EXACT_FILTER].esize = sizeof(uint64_t);
+	data[SEC_WILD_FILTER] = wild_filter.v.blocks;
+	hdr.sec[SEC_WILD_FILTER].len = wild_filter.blocks.size() * sizeof(uint64_t);
+	hdr.sec[SEC_WILD_FILTER].esize = sizeof(uint64_t);
+	data[SEC_FORWARD] = v.fwds;
+	hdr.sec[SEC_FORWARD].len = v.nfwds * sizeof(uint32_t);
+	hdr.sec[SEC_FORWARD].esize = sizeof(uint32_t);
+
+	const prefix_table *nets[2] = {&nets4, &nets6};
+	for (int i = 0; i < 2; ++i) {
+		int top = i == 0 ? SEC_NETS4_TOP : SEC_NETS6_TOP;
+		data[top] = nets[i]->v.top;
+		hdr.sec[top].len = nets[i]->top.size() * sizeof(uint32_t);
+		hdr.sec[top].esize = sizeof(uint32_t);
+		data[top + 1] = nets[i]->v.nodes;
+		hdr.sec[top + 1].len = nets[i]->nodes.size() * sizeof(prefix_table::node);
+		hdr.sec[top + 1].esize = sizeof(prefix_table::node);
+		data[top + 2] = nets[i]->v.leaves;
+		hdr.sec[top + 2].len = nets[i]->leaves.size() * sizeof(uint16_t);
+		hdr.sec[top + 2].esize = sizeof(uint16_t);
+	}
+
+	uint64_t off = (sizeof(hdr) + 63) & ~63ULL;
+	for (int i = 0; i < SEC_MAX; ++i) {
+		hdr.sec[i].off = off;
+		off = (off + hdr.sec[i].len + 63) & ~63ULL;
+	}
+
+	string tmp = file + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	static const char zeros[64] = {0};
+	uint64_t pos = sizeof(hdr);
+
+	int r = write_all(fd, &hdr, sizeof(hdr));
+	for (int i = 0; r == 0 && i < SEC_MAX; ++i) {
+		if ((r = write_all(fd, zeros, hdr.sec[i].off - pos)) < 0)
+			break;
+		r = write_all(fd, data[i], hdr.sec[i].len);
+		pos = hdr.sec[i].off + hdr.sec[i].len;
+	}
+
+	if (r < 0 || fsync(fd) < 0) {
+		int e = errno;
+		close(fd);
+		unlink(tmp.c_str());
+		errno = e;
+		return -1;
+	}
+	close(fd);
+
+	// replace atomically, servers may be mapping the old one
+	return rename(tmp.c_str(), file.c_str());
+}
+
+
+int zone::load(const string &file)
+{
+	if (map || answers.size() > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(image_hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	const char *base = static_cast<const char *>(m);
+	image_hdr hdr;
+	memcpy(&hdr, base, sizeof(hdr));
+
+	const uint64_t esize[SEC_MAX] = {
+		1, sizeof(answer), sizeof(rrset), sizeof(name_index::slot), 1,
+		sizeof(uint32_t), sizeof(label_trie::edge), sizeof(label_trie::value), 1,
+		sizeof(uint64_t), sizeof(uint64_t), sizeof(uint32_t),
+		sizeof(uint32_t), sizeof(prefix_table::node), sizeof(uint16_t),
+		sizeof(uint32_t), sizeof(prefix_table::node), sizeof(uint16_t)
+	};
+
+	bool ok = (memcmp(hdr.magic, image_magic, sizeof(hdr.magic)) == 0 &&
+	           hdr.version == image_version && hdr.byteorder == image_byteorder);
+
+	for (int i = 0; ok && i < SEC_MAX; ++i) {
+		ok = (hdr.sec[i].esize == esize[i] && hdr.sec[i].off % 64 == 0 &&
+		      hdr.sec[i].len % esize[i] == 0 && hdr.sec[i].off <= (uint64_t)st.st_size &&
+		      hdr.sec[i].len <= (uint64_t)st.st_size - hdr.sec[i].off);
+	}
+
+	// hash tables must be a power of 2 in size, and the trie has at least its root
+	uint64_t nslots = hdr.sec[SEC_EXACT_SLOTS].len / esize[SEC_EXACT_SLOTS];
+	uint64_t nedges = hdr.sec[SEC_WILD_EDGES].len / esize[SEC_WILD_EDGES];
+	ok = ok && nslots > 0 && (nslots & (nslots - 1)) == 0 && nedges > 0 && (nedges & (nedges - 1)) == 0 &&
+	     hdr.sec[SEC_WILD_NODES].len > 0 && hdr.exact_used < nslots && hdr.wild_used < nedges;
+
+	// and so are the filters in blocks, or they are empty
+	const uint64_t block_size = sizeof(uint64_t) * name_filter::block_words;
+	uint64_t exact_blocks = hdr.sec[SEC_EXACT_FILTER].len / block_size;
+	uint64_t wild_blocks = hdr.sec[SEC_WILD_FILTER].len / block_size;
+	ok = ok && hdr.sec[SEC_EXACT_FILTER].len % block_size == 0 && (exact_blocks & (exact_blocks - 1)) == 0 &&
+	     hdr.sec[SEC_WILD_FILTER].len % block_size == 0 && (wild_blocks & (wild_blocks - 1)) == 0;
+
+	// there is a forward entry for view 0 at least, and the network
+	// tables have a full top level, or nothing
+	const uint64_t top_len = prefix_table::top_size * sizeof(uint32_t);
+	ok = ok && hdr.sec[SEC_FORWARD].len > 0 &&
+	     (hdr.sec[SEC_NETS4_TOP].len == 0 || hdr.sec[SEC_NETS4_TOP].len == top_len) &&
+	     (hdr.sec[SEC_NETS6_TOP].len == 0 || hdr.sec[SEC_NETS6_TOP].len == top_len);
+
+	if (!ok) {
+		munmap(m, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = m;
+	map_len = st.st_size;
+
+	v.arena = base + hdr.sec[SEC_ARENA].off;
+	v.answers = reinterpret_cast<const answer *>(base + hdr.sec[SEC_ANSWERS].off);
+	v.rrsets = reinterpret_cast<const rrset *>(base + hdr.sec[SEC_RRSETS].off);
+	v.nrrsets = hdr.sec[SEC_RRSETS].len / sizeof(rrset);
+	v.fwds = reinterpret_cast<const uint32_t *>(base + hdr.sec[SEC_FORWARD].off);
+	v.nfwds = hdr.sec[SEC_FORWARD].len / sizeof(uint32_t);
+
+	exact.v.slots = reinterpret_cast<const name_index::slot *>(base + hdr.sec[SEC_EXACT_SLOTS].off);
+	exact.v.names = base + hdr.sec[SEC_EXACT_NAMES].off;
+	exact.v.nslots = nslots;
+	exact.used = hdr.exact_used;
+
+	wild.v.nodes = reinterpret_cast<const uint32_t *>(base + hdr.sec[SEC_WILD_NODES].off);
+	wild.v.edges = reinterpret_cast<const label_trie::edge *>(base + hdr.sec[SEC_WILD_EDGES].off);
+	wild.v.values = reinterpret_cast<const label_trie::value *>(base + hdr.sec[SEC_WILD_VALUES].off);
+	wild.v.labels = base + hdr.sec[SEC_WILD_LABELS].off;
+	wild.v.nedges = nedges;
+	wild.used = hdr.wild_used;
+
+	exact_filter.v.blocks = exact_blocks ? reinterpret_cast<const uint64_t *>(base + hdr.sec[SEC_EXACT_FILTER].off) : nullptr;
+	exact_filter.v.mask = exact_blocks ? exact_blocks - 1 : 0;
+	wild_filter.v.blocks = wild_blocks ? reinterpret_cast<const uint64_t *>(base + hdr.sec[SEC_WILD_FILTER].off) : nullptr;
+	wild_filter.v.mask = wild_blocks ? wild_blocks - 1 : 0;
+	wild_depths[0] = hdr.wild_depths[0];
+	wild_depths[1] = hdr.wild_depths[1];
+
+	prefix_table *nets[2] = {&nets4, &nets6};
+	for (int i = 0; i < 2; ++i) {
+		int top = i == 0 ? SEC_NETS4_TOP : SEC_NETS6_TOP;
+		nets[i]->v.top = hdr.sec[top].len ? reinterpret_cast<const uint32_t *>(base + hdr.sec[top].off) : nullptr;
+		nets[i]->v.nodes = reinterpret_cast<const prefix_table::node *>(base + hdr.sec[top + 1].off);
+		nets[i]->v.leaves = reinterpret_cast<const uint16_t *>(base + hdr.sec[top + 2].off);
+	}
+
+	return 0;
+}
+
+
+} // namespace
+
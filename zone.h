@@ -0,0 +1,457 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef qdns_zone_h
+#define qdns_zone_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/socket.h>
+#include "lpm.h"
+
+
+namespace qdns {
+
+
+// Appends byte strings to a store such as an arena only once: adding
+// one that is already in there yields the offset of the first copy.
+// Only used while a zone is built; an open-addressing table of the
+// offsets, like the indexes below.
+class interner {
+
+	struct entry {
+		uint32_t hash;
+		uint32_t off, len;	// len + 1, so that 0 marks an empty slot
+	};
+
+	std::vector<entry> table;
+	size_t used;
+
+	int grow();
+
+public:
+
+	interner() : used(0)
+	{
+	}
+
+	// off is where s is in store afterwards
+	int add(std::string &store, const char *s, size_t len, uint32_t &off);
+
+	void clear()
+	{
+		std::vector<entry>().swap(table);
+		used = 0;
+	}
+};
+
+
+// Wildcard index. DNS names are stored label by label from the
+// rightmost one, so "\006google\003com\000" becomes root -> "com" -> "google".
+// A lookup walks the qname's labels the same way and remembers the deepest
+// node carrying a value for the qtype, which is the longest wildcard suffix
+// on label boundaries. Children are kept in one flat open-addressing table
+// keyed by (parent, label), so each step costs one hash probe. Values
+// belong to a view; see zone.
+class label_trie {
+
+	struct edge {
+		uint32_t hash;
+		uint32_t parent, child;
+		uint32_t label_off;	// into labels
+		uint8_t label_len;
+	};
+
+	// per node linked list of (qtype, view, value)
+	struct value {
+		uint16_t qtype, view;
+		uint32_t val;
+		uint32_t next;
+	};
+
+	enum : uint32_t {
+		no_value = 0xffffffff
+	};
+
+	std::vector<uint32_t> nodes;	// node id -> first value or no_value
+	std::vector<edge> edges;	// hash table, child == 0 means empty slot
+	std::vector<value> values;
+	std::string labels;
+	interner label_pool;
+	size_t used;
+
+	// What lookups use: either the vectors above or a mapped zone image
+	struct {
+		const uint32_t *nodes;
+		const edge *edges;
+		const value *values;
+		const char *labels;
+		size_t nedges;
+	} v;
+
+	static uint32_t hash(uint32_t, const char *, uint8_t);
+
+	uint32_t child(uint32_t, const char *, uint8_t) const;
+
+	int grow();
+
+	void sync();
+
+	friend class zone;
+
+public:
+
+	label_trie() : labels(""), used(0)
+	{
+		clear();
+	}
+
+	void clear();
+
+	// qname in DNS wire format
+	int insert(const std::string &qname, uint16_t qtype, uint16_t view, uint32_t val);
+
+	// longest suffix of qname that has a value for qtype in view or in
+	// view 0, the one of view if both have
+	bool find(const char *qname, size_t len, uint16_t qtype, uint16_t view, uint32_t &val) const;
+
+	bool find(const char *qname, size_t len, uint16_t qtype, uint32_t &val) const
+	{
+		return find(qname, len, qtype, 0, val);
+	}
+};
+
+
+// Exact (qname, qtype) index. One flat open-addressing table of 16 byte
+// slots with the names kept back to back in a separate string, so a lookup
+// hashes the wire format qname once and usually touches a single slot
+// before the final memcmp(). The view is not hashed, so a name's entries
+// of all views are on the same probe sequence.
+class name_index {
+
+	struct slot {
+		uint32_t hash;
+		uint32_t name_off;	// into names
+		uint32_t val;
+		uint16_t qtype;
+		uint8_t name_len;	// 0 marks an empty slot
+		uint8_t view;
+	};
+
+	std::vector<slot> slots;
+	std::string names;
+	interner name_pool;	// a name with several qtypes is kept once
+	size_t used;
+
+	// What lookups use: either the vectors above or a mapped zone image
+	struct {
+		const slot *slots;
+		const char *names;
+		size_t nslots;
+	} v;
+
+	int grow();
+
+	void sync();
+
+	friend class zone;
+
+public:
+
+	name_index() : names(""), used(0)
+	{
+		clear();
+	}
+
+	// the lower half of hash64()
+	static uint32_t hash(const char *, size_t, uint16_t);
+
+	static uint64_t hash64(const char *, size_t, uint64_t seed);
+
+	void clear();
+
+	int reserve(size_t);
+
+	// qname in DNS wire format; views are 0 to max_view
+	int insert(const std::string &qname, uint16_t qtype, uint16_t view, uint32_t val);
+
+	int insert(const std::string &qname, uint16_t qtype, uint32_t val)
+	{
+		return insert(qname, qtype, 0, val);
+	}
+
+	bool find(const char *qname, size_t len, uint16_t qtype, uint32_t &val) const
+	{
+		return find(qname, len, qtype, 0, hash(qname, len, qtype), val);
+	}
+
+	// the entry of view, else the one of view 0; with h from hash()
+	bool find(const char *qname, size_t len, uint16_t qtype, uint16_t view, uint32_t h, uint32_t &val) const;
+
+	enum {
+		max_view = 255
+	};
+
+	size_t size() const
+	{
+		return used;
+	}
+};
+
+
+// Negative filter in front of an index, against floods of random
+// names. A blocked Bloom filter: every key sets a few bits inside one
+// 64 byte block, so a test touches a single cache line. A key that
+// tests negative was never added; a positive one may be a false hit,
+// about one in a hundred at the size build() picks.
+class name_filter {
+
+	enum {
+		block_words = 8,
+		block_bits = 64*block_words,
+		bits_per_key = 12,
+		probes = 6
+	};
+
+	std::vector<uint64_t> blocks;
+
+	// What tests use: either the vector above or a mapped zone image
+	struct {
+		const uint64_t *blocks;
+		size_t mask;		// number of blocks - 1
+	} v;
+
+	void sync();
+
+	friend class zone;
+
+public:
+
+	name_filter()
+	{
+		clear();
+	}
+
+	void clear();
+
+	// size the filter for these keys and add them
+	int build(const std::vector<uint64_t> &keys);
+
+	// an empty filter holds everything
+	bool empty() const
+	{
+		return v.blocks == nullptr;
+	}
+
+	bool test(uint64_t key) const
+	{
+		const uint64_t *b = v.blocks + block_words*((key>>32) & v.mask);
+		uint64_t g = (key ^ (key>>29)) * 0xbf58476d1ce4e5b9ULL;
+
+		for (int i = 0; i < probes; ++i, g >>= 9) {
+			unsigned bit = g & (block_bits - 1);
+			if ((b[bit/64] & (1ULL<<(bit % 64))) == 0)
+				return 0;
+		}
+		return 1;
+	}
+};
+
+
+// A zone as it is served: read-only once built, shared by all workers.
+// Every answer of every rrset lives in one arena, and rrsets are
+// addressed by a dense id which also indexes the per-worker
+// round-robin positions.
+//
+// Nothing in here contains a pointer, so save() can dump all tables
+// into a file as they are, and load() serves straight from an mmap()
+// of that file: no parsing at startup, and processes serving the same
+// image share its pages.
+//
+// Rrsets belong to a view. View 0 is for everyone; the others are for
+// clients in their networks, which view() finds by longest prefix
+// match. A client in a view gets that view's rrset of a name and qtype
+// where it has one, and the one of view 0 otherwise.
+class zone {
+public:
+
+	// hdr is the complete reply header for this answer: QR set,
+	// one question and the RR counts. Only the query's ID, RD, AD and
+	// CD bits and the RCODE are patched in per reply. ttl is in
+	// network order.
+	struct answer {
+		uint32_t rr_off, rr_len;	// answer RRs inside arena
+		uint32_t field_off, field_len;	// human readable copy for logging
+		uint32_t ttl;
+		char hdr[12];
+	};
+
+	// answers[first] ... answers[first + count - 1], answered round-robin
+	struct rrset {
+		uint32_t first, count;
+	};
+
+	enum : uint32_t {
+		npos = 0xffffffff,
+		max_view = name_index::max_view
+	};
+
+private:
+
+	// identical RRs and fields, such as the same address for many
+	// names, are kept once
+	std::string arena;
+	interner arena_pool;
+	std::vector<answer> answers;
+	std::vector<rrset> rrsets;
+
+	// the [forward] SOA rrset of each view
+	std::vector<uint32_t> fwds;
+
+	struct {
+		const char *arena;
+		const answer *answers;
+		const rrset *rrsets;
+		size_t nrrsets;
+		const uint32_t *fwds;
+		size_t nfwds;
+	} v;
+
+	name_index exact;
+	label_trie wild;
+
+	// what is in exact and in wild, and which numbers of labels
+	// wildcard names have, 0 to 127; see find()
+	name_filter exact_filter, wild_filter;
+	std::vector<uint64_t> exact_keys, wild_keys;
+	uint64_t wild_depths[2];
+
+	bool may_be_wild(const char *qname, size_t len, uint16_t qtype) const;
+
+	// client networks -> view
+	prefix_table nets4, nets6;
+
+	uint16_t find_view(const sockaddr_storage &) const;
+
+	// first answer not yet claimed by add_rrset()
+	uint32_t pending;
+
+	// the image, if load()ed
+	void *map;
+	size_t map_len;
+
+	void sync();
+
+public:
+
+	zone() : arena(""), fwds(1, npos), pending(0), map(nullptr), map_len(0)
+	{
+		wild_depths[0] = wild_depths[1] = 0;
+		sync();
+	}
+
+	~zone();
+
+	// write a zone image
+	int save(const std::string &) const;
+
+	// serve from the image in this file
+	int load(const std::string &);
+
+	// whether file starts like a zone image
+	static bool is_image(const std::string &);
+
+	// the answers of an rrset are added in a row, followed by
+	// add_rrset() which takes all answers added since the last rrset
+	int add_answer(const std::string &rr, const std::string &field, uint32_t ttl,
+	               uint16_t a_count, uint16_t rra_count, uint16_t ad_count);
+
+	int add_rrset(const std::string &qname, uint16_t qtype, bool wildcard, uint16_t view = 0);
+
+	// clients in the network addr/len get view; addr is an in_addr or
+	// in6_addr, as of family
+	int add_network(int family, const void *addr, unsigned len, uint16_t view);
+
+	// after the last add_rrset(): build the filters for find() and the
+	// tables for view(), and drop what only building needs
+	int finish();
+
+	// the view of a client, 0 if it is in none
+	uint16_t view(const sockaddr_storage &peer) const
+	{
+		if (nets4.empty() && nets6.empty())
+			return 0;
+		return find_view(peer);
+	}
+
+	// the exact match, else the longest wildcard suffix, in view or
+	// view 0; either index is skipped if its filter says it cannot
+	// have qname
+	uint32_t find(const char *qname, size_t len, uint16_t qtype, uint16_t view, bool &wildcard) const;
+
+	uint32_t find_exact(const char *qname, size_t len, uint16_t qtype) const
+	{
+		uint32_t id = npos;
+		exact.find(qname, len, qtype, id);
+		return id;
+	}
+
+	// longest wildcard suffix of qname
+	uint32_t find_wild(const char *qname, size_t len, uint16_t qtype) const
+	{
+		uint32_t id = npos;
+		wild.find(qname, len, qtype, id);
+		return id;
+	}
+
+	// the [forward] SOA rrset for NXDOMAIN answers, if any
+	uint32_t forward(uint16_t view = 0) const
+	{
+		if (view < v.nfwds && v.fwds[view] != npos)
+			return v.fwds[view];
+		return v.fwds[0];
+	}
+
+	const rrset &set(uint32_t id) const
+	{
+		return v.rrsets[id];
+	}
+
+	const answer &get(const rrset &rs, uint32_t pos) const
+	{
+		return v.answers[rs.first + pos];
+	}
+
+	const char *data(uint32_t off) const
+	{
+		return v.arena + off;
+	}
+
+	size_t size() const
+	{
+		return v.nrrsets;
+	}
+};
+
+
+} // namespace
+
+#endif
+
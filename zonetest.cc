@@ -0,0 +1,173 @@
+/*
+ * This file is part of quantum-dns.
+ *
+ * (C) 2014-2018 by Sebastian Krahmer, sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * quantum-dns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * quantum-dns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with quantum-dns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// zone lookups of parsed zone files and of their images, run via "make check"
+
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "qdns.h"
+#include "zone.h"
+#include "misc.h"
+
+
+using namespace std;
+
+
+namespace qdns {
+
+struct test_access {
+
+	static const zone *get(qdns &q)
+	{
+		return q.z.load();
+	}
+};
+
+}
+
+
+namespace {
+
+enum result {
+	MISS,
+	EXACT,
+	WILD
+};
+
+
+struct lookup {
+	const char *name;
+	result expect;
+};
+
+
+struct zone_case {
+	const char *what, *text;
+	lookup lookups[8];
+};
+
+
+const zone_case cases[] = {
+	{"root wildcard", "*\t3600\tIN\tA\t192.0.2.1\n",
+	 {{"anything.com", WILD}, {"a.b.c", WILD}, {nullptr, MISS}}},
+
+	{"root wildcard with dot", "*.\t3600\tIN\tA\t192.0.2.1\n",
+	 {{"anything.com", WILD}, {"com", WILD}, {nullptr, MISS}}},
+
+	{"root wildcard below others",
+	 "*\t3600\tIN\tA\t192.0.2.1\n"
+	 "*.example.com\t3600\tIN\tA\t192.0.2.2\n"
+	 "www.example.com\t3600\tIN\tA\t192.0.2.3\n",
+	 {{"www.example.com", EXACT}, {"x.example.com", WILD}, {"example.org", WILD}, {nullptr, MISS}}},
+
+	{"subdomain wildcard",
+	 "*.example.com\t3600\tIN\tA\t192.0.2.2\n",
+	 {{"example.com", WILD}, {"a.b.example.com", WILD}, {"example.org", MISS}, {"com", MISS}, {nullptr, MISS}}},
+};
+
+
+string write_zone(const char *text)
+{
+	char path[] = "/tmp/qdns-zonetest.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return "";
+
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(path);
+		return "";
+	}
+	fputs(text, f);
+	fclose(f);
+	return path;
+}
+
+
+int check(const char *what, const char *from, const qdns::zone *z, const lookup *lookups)
+{
+	int failed = 0;
+	const uint16_t qtype_a = htons(1);
+
+	for (const lookup *l = lookups; l->name; ++l) {
+		string qname = "";
+		qdns::host2qname(l->name, qname);
+
+		bool wild = 0;
+		uint32_t id = z->find(qname.c_str(), qname.size(), qtype_a, 0, wild);
+		result r = id == qdns::zone::npos ? MISS : (wild ? WILD : EXACT);
+		if (r != l->expect) {
+			printf("FAIL %s (%s): %s\n", what, from, l->name);
+			++failed;
+		}
+	}
+	return failed;
+}
+
+
+int run(const zone_case &c)
+{
+	string file = write_zone(c.text), image = file + ".img";
+	if (file.empty()) {
+		perror("write_zone");
+		return 1;
+	}
+
+	qdns::qdns q, qi;
+	int failed = 0;
+
+	// parse_zone() tells how many RRs it found
+	streambuf *sb = cout.rdbuf(nullptr);
+	int r = q.parse_zone(file);
+	if (r == 0 && (r = q.save_zone(image)) == 0)
+		r = qi.parse_zone(image);
+	cout.rdbuf(sb);
+	cout.clear();
+	unlink(file.c_str());
+	unlink(image.c_str());
+
+	if (r < 0) {
+		printf("FAIL %s: %s %s\n", c.what, q.why(), qi.why());
+		return 1;
+	}
+
+	failed += check(c.what, "zone file", qdns::test_access::get(q), c.lookups);
+	failed += check(c.what, "zone image", qdns::test_access::get(qi), c.lookups);
+	if (!failed)
+		printf("ok   %s\n", c.what);
+	return failed;
+}
+
+}
+
+
+int main()
+{
+	int failed = 0;
+
+	for (const zone_case &c : cases)
+		failed += run(c);
+	return failed ? 1 : 0;
+}